@@ -2,6 +2,9 @@
 // Computer Graphics Sample Program: GPU ray casting
 //=============================================================================================
 #include "framework.h"
+#include <algorithm>
+#include <new>
+#include <type_traits>
 
 // vertex shader in GLSL
 const char *vertexSource = R"(
@@ -258,32 +261,94 @@ public:
 
 float rnd() { return (float)rand() / RAND_MAX; }
 
+//---------------------------
+class Arena {	// storage of the scene entities, objects of one type are packed in blocks of that type
+//---------------------------
+	static const size_t blockSize = 1 << 16;
+	struct Pool {
+		std::vector<void *> blocks;
+		size_t objectSize = 0, blockCapacity = 0;
+		size_t count = 0;	// objects in use, the first count slots over the blocks
+		void (*destroy)(void *) = nullptr;	// null for trivially destructible types
+
+		void * allocate() {
+			size_t block = count / blockCapacity, slot = count % blockCapacity;
+			if (block == blocks.size()) blocks.push_back(::operator new(objectSize * blockCapacity));
+			count++;
+			return (char *)blocks[block] + slot * objectSize;
+		}
+		void clear() {	// nothing is visited for trivially destructible types
+			if (destroy) for (size_t i = count; i-- > 0;) destroy((char *)blocks[i / blockCapacity] + i % blockCapacity * objectSize);
+			count = 0;
+		}
+	};
+	std::vector<Pool> pools;	// indexed by typeIndex
+
+	static int nextTypeIndex() { static int n = 0; return n++; }
+	template <class T> static int typeIndex() { static const int index = nextTypeIndex(); return index; }
+public:
+	Arena() { }
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	~Arena() {
+		clear();
+		for (Pool& pool : pools)
+			for (void * block : pool.blocks) ::operator delete(block);
+	}
+
+	template <class T, class... Args> T * make(Args&&... args) {
+		int index = typeIndex<T>();
+		if (index >= (int)pools.size()) pools.resize(index + 1);
+		Pool& pool = pools[index];
+		if (pool.objectSize == 0) {
+			pool.objectSize = sizeof(T);
+			pool.blockCapacity = std::max(blockSize / sizeof(T), (size_t)1);
+			if (!std::is_trivially_destructible<T>::value) pool.destroy = [](void * object) { ((T *)object)->~T(); };
+		}
+		return new (pool.allocate()) T(std::forward<Args>(args)...);
+	}
+
+	void clear() { for (Pool& pool : pools) pool.clear(); }	// the blocks are kept for the next build
+};
+
 //---------------------------
 class Scene {
 //---------------------------
+	Arena arena;	// owns the spheres, lights and materials
 	std::vector<Sphere *> objects;
 	std::vector<Light *> lights;
 	Camera camera;
 	std::vector<Material *> materials;
 public:
-	void build() {
+	void build() {	// replaces the current content, the memory of the entities is reused
+		objects.clear();
+		lights.clear();
+		materials.clear();
+		arena.clear();
 		vec3 eye = vec3(0, 0, 2);
 		vec3 vup = vec3(0, 1, 0);
 		vec3 lookat = vec3(0, 0, 0);
 		float fov = 45 * (float)M_PI / 180;
 		camera.set(eye, lookat, vup, fov);
 
-		lights.push_back(new Light(vec3(1, 1, 1), vec3(3, 3, 3), vec3(0.4f, 0.3f, 0.3f)));
+		lights.push_back(arena.make<Light>(vec3(1, 1, 1), vec3(3, 3, 3), vec3(0.4f, 0.3f, 0.3f)));
 
 		vec3 kd(0.3f, 0.2f, 0.1f), ks(10, 10, 10);
-		materials.push_back(new RoughMaterial(kd, ks, 50));
-		materials.push_back(new SmoothMaterial(vec3(0.9f, 0.85f, 0.8f)));
+		materials.push_back(arena.make<RoughMaterial>(kd, ks, 50));
+		materials.push_back(arena.make<SmoothMaterial>(vec3(0.9f, 0.85f, 0.8f)));
 
 		for (int i = 0; i < 500; i++)
-			objects.push_back(new Sphere(vec3(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f), rnd() * 0.1f));
+			objects.push_back(arena.make<Sphere>(vec3(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f), rnd() * 0.1f));
 
 	}
 
+	void release() {	// frees the entities while the OpenGL context is still alive
+		objects.clear();
+		lights.clear();
+		materials.clear();
+		arena.clear();
+	}
+
 	void setUniform(Shader& shader) {
 		shader.setUniformObjects(objects);
 		shader.setUniformMaterials(materials);
@@ -325,6 +390,11 @@ public:
 
 FullScreenTexturedQuad fullScreenTexturedQuad;
 
+// Window is closed, the OpenGL context is still alive
+void onClose() {
+	scene.release();
+}
+
 // Initialization, create an OpenGL context
 void onInitialization() {
 	glViewport(0, 0, windowWidth, windowHeight);
@@ -334,6 +404,11 @@ void onInitialization() {
 	// create program for the GPU
 	shader.create(vertexSource, fragmentSource, "fragmentColor");
 	shader.Use();
+#if defined(__APPLE__)
+	glutWMCloseFunc(onClose);
+#else
+	glutCloseFunc(onClose);
+#endif
 }
 
 // Window has become invalid: Redraw
@@ -1,162 +1,87 @@
 //=============================================================================================
 // Computer Graphics Sample Program: Ray-tracing-let
 //=============================================================================================
-#include "framework.h"
-
-struct Material {
-    vec3 ka, kd, ks;
-    float  shininess;
-    Material(vec3 _kd, vec3 _ks, float _shininess) : ka(_kd * M_PI), kd(_kd), ks(_ks) { shininess = _shininess; }
-};
-
-struct Hit {
-    float t;
-    vec3 position, normal;
-    Material * material;
-    Hit() { t = -1; }
-};
-
-struct Ray {
-    vec3 start, dir;
-    Ray(vec3 _start, vec3 _dir) {
-        start = _start;
-        dir = normalize(_dir);
-    }
-};
-
-class Intersectable {
-protected:
-    Material * material;
-public:
-    virtual Hit intersect(const Ray& ray) = 0;
-};
-
-struct Sphere : public Intersectable {
-    vec3 center;
-    float radius;
-
-    Sphere(const vec3& _center, float _radius, Material* _material) {
-        center = _center;
-        radius = _radius;
-        material = _material;
-    }
-
-    Hit intersect(const Ray& ray) {
-        Hit hit;
-        vec3 dist = ray.start - center;
-        float a = dot(ray.dir, ray.dir);
-        float b = dot(dist, ray.dir) * 2.0f;
-        float c = dot(dist, dist) - radius * radius;
-        float discr = b * b - 4.0f * a * c;
-        if (discr < 0) return hit;
-        float sqrt_discr = sqrtf(discr);
-        float t1 = (-b + sqrt_discr) / 2.0f / a;	// t1 >= t2 for sure
-        float t2 = (-b - sqrt_discr) / 2.0f / a;
-        if (t1 <= 0) return hit;
-        hit.t = (t2 > 0) ? t2 : t1;
-        hit.position = ray.start + ray.dir * hit.t;
-        hit.normal = (hit.position - center) * (1.0f / radius);
-        hit.material = material;
-        return hit;
-    }
-};
-
-class Camera {
-    vec3 eye, lookat, right, up;
+#include "raytracer.h"
+#include "denoiser.h"
+
+// Renders the scene on a background thread in passes of 4x4, 2x2 and 1x1 pixel blocks, so a coarse
+// preview (1/16 of the rays) appears almost at once and is refined in place. Finished tiles are queued
+// with a copy of their pixels; the GLUT thread takes them in onIdle and uploads them to the texture.
+// The statistics of the scene are reset at start, complete tells once that the last pass has finished.
+// If the scene records the features of the denoiser, the final image is filtered and queued as one tile.
+class ProgressiveRenderer {
 public:
-    void set(vec3 _eye, vec3 _lookat, vec3 vup, float fov) {
-        eye = _eye;
-        lookat = _lookat;
-        vec3 w = eye - lookat;
-        float focus = length(w);
-        right = normalize(cross(vup, w)) * focus * tanf(fov / 2);
-        up = normalize(cross(w, right)) * focus * tanf(fov / 2);
-    }
-    Ray getRay(int X, int Y) {
-        vec3 dir = lookat + right * (2.0f * (X + 0.5f) / windowWidth - 1) + up * (2.0f * (Y + 0.5f) / windowHeight - 1) - eye;
-        return Ray(eye, dir);
-    }
-};
-
-struct Light {
-    vec3 direction;
-    vec3 Le;
-    Light(vec3 _direction, vec3 _Le) {
-        direction = normalize(_direction);
-        Le = _Le;
+    struct Tile {
+        int X0, Y0, width, height;
+        std::vector<vec4> pixels;
+    };
+private:
+    std::thread thread;
+    std::atomic<bool> cancelled, completed;
+    std::mutex mutex;
+    std::vector<Tile> finished;
+
+    void run(Scene * scene) {
+        auto timeStart = std::chrono::steady_clock::now();
+        std::vector<vec4> image(scene->width * scene->height);
+        for (int step = 4; step >= 1; step /= 2) {
+            scene->renderTiles(step, [&](int X0, int Y0, int X1, int Y1, const vec4 * pixels) {
+                Tile tile = { X0, Y0, X1 - X0, Y1 - Y0, std::vector<vec4>(pixels, pixels + (X1 - X0) * (Y1 - Y0)) };
+                for (int Y = Y0; Y < Y1; Y++) std::copy(pixels + (Y - Y0) * (X1 - X0), pixels + (Y - Y0 + 1) * (X1 - X0), &image[Y * scene->width + X0]);
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.push_back(std::move(tile));
+            }, &cancelled);
+            if (cancelled) return;
+            long ms = (long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - timeStart).count();
+            printf("Rendering time (%s%s%s, %dx%d blocks): %ld milliseconds\n", acceleratorNames[scene->accelerator],
+                   scene->usePackets ? ", packets" : "", scene->shadowGrids ? ", shadow grids" : "", step, step, ms);
+        }
+        if (scene->recordFeatures) {
+            auto denoiseStart = std::chrono::steady_clock::now();
+            denoise(image, scene->normals, scene->depths, scene->width, scene->height, *scene->pool);
+            long ms = (long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - denoiseStart).count();
+            printf("Denoising time: %ld milliseconds\n", ms);
+            Tile tile = { 0, 0, scene->width, scene->height, std::move(image) };
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.push_back(std::move(tile));
+        }
+        completed = true;
     }
-};
-
-float rnd() { return (float)rand() / RAND_MAX; }
-
-const float epsilon = 0.0001f;
-
-class Scene {
-    std::vector<Intersectable *> objects;
-    std::vector<Light *> lights;
-    Camera camera;
-    vec3 La;
 public:
-    void build() {
-        vec3 eye = vec3(0, 0, 2), vup = vec3(0, 1, 0), lookat = vec3(0, 0, 0);
-        float fov = 45 * M_PI / 180;
-        camera.set(eye, lookat, vup, fov);
-
-        La = vec3(0.4f, 0.4f, 0.4f);
-        vec3 lightDirection(1, 1, 1), Le(2, 2, 2);
-        lights.push_back(new Light(lightDirection, Le));
-
-        vec3 kd(0.3f, 0.2f, 0.1f), ks(2, 2, 2);
-        Material * material = new Material(kd, ks, 50);
-        for (int i = 0; i < 100; i++)
-            objects.push_back(new Sphere(vec3(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f), rnd() * 0.1f, material));
+    ProgressiveRenderer() : cancelled(false), completed(false) { }
+    ~ProgressiveRenderer() { cancel(); }
+
+    void start(Scene& scene) {	// a render in progress is cancelled first
+        cancel();
+        cancelled = false;
+        completed = false;
+        scene.resetStats();
+        thread = std::thread(&ProgressiveRenderer::run, this, &scene);
     }
 
-    void render(std::vector<vec4>& image) {
-        for (int Y = 0; Y < windowHeight; Y++) {
-#pragma omp parallel for
-            for (int X = 0; X < windowWidth; X++) {
-                vec3 color = trace(camera.getRay(X, Y));
-                image[Y * windowWidth + X] = vec4(color.x, color.y, color.z, 1);
-            }
-        }
+    void cancel() {
+        cancelled = true;
+        if (thread.joinable()) thread.join();
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.clear();
     }
 
-    Hit firstIntersect(Ray ray) {
-        Hit bestHit;
-        for (Intersectable * object : objects) {
-            Hit hit = object->intersect(ray); //  hit.t < 0 if no intersection
-            if (hit.t > 0 && (bestHit.t < 0 || hit.t < bestHit.t))  bestHit = hit;
-        }
-        if (dot(ray.dir, bestHit.normal) > 0) bestHit.normal = bestHit.normal * (-1);
-        return bestHit;
-    }
+    bool complete() { return completed.exchange(false); }
 
-    bool shadowIntersect(Ray ray) {	// for directional lights
-        for (Intersectable * object : objects) if (object->intersect(ray).t > 0) return true;
-        return false;
-    }
-
-    vec3 trace(Ray ray, int depth = 0) {
-        Hit hit = firstIntersect(ray);
-        if (hit.t < 0) return La;
-        vec3 outRadiance = hit.material->ka * La;
-        for (Light * light : lights) {
-            Ray shadowRay(hit.position + hit.normal * epsilon, light->direction);
-            float cosTheta = dot(hit.normal, light->direction);
-            if (cosTheta > 0 && !shadowIntersect(shadowRay)) {	// shadow computation
-                outRadiance = outRadiance + light->Le * hit.material->kd * cosTheta;
-                vec3 halfway = normalize(-ray.dir + light->direction);
-                float cosDelta = dot(hit.normal, halfway);
-                if (cosDelta > 0) outRadiance = outRadiance + light->Le * hit.material->ks * powf(cosDelta, hit.material->shininess);
-            }
-        }
-        return outRadiance;
+    std::vector<Tile> takeFinished() {
+        std::vector<Tile> tiles;
+        std::lock_guard<std::mutex> lock(mutex);
+        tiles.swap(finished);
+        return tiles;
     }
 };
 
 GPUProgram gpuProgram; // vertex and fragment shaders
 Scene scene;
+ProgressiveRenderer renderer;
+const int pathSamples = 16;	// samples per pixel of path tracing and the most of adaptive anti-aliasing
+uint64_t uploadTime = 0;	// nanoseconds of texture uploads since the render started
+bool animating = false;		// move the scene and render the next frame once a frame is complete
 
 // vertex shader in GLSL
 const char *vertexSource = R"(
@@ -207,6 +132,11 @@ public:
         glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);     // stride and offset: it is tightly packed
     }
 
+    void LoadTile(const ProgressiveRenderer::Tile& tile) {	// replace a rectangle of the texture
+        glBindTexture(GL_TEXTURE_2D, texture.textureId);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, tile.X0, tile.Y0, tile.width, tile.height, GL_RGBA, GL_FLOAT, &tile.pixels[0]);
+    }
+
     void Draw() {
         glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
         gpuProgram.setUniform(texture, "textureUnit");
@@ -219,16 +149,17 @@ FullScreenTexturedQuad * fullScreenTexturedQuad;
 // Initialization, create an OpenGL context
 void onInitialization() {
     glViewport(0, 0, windowWidth, windowHeight);
-    scene.build();
-
-    std::vector<vec4> image(windowWidth * windowHeight);
+    scene.timeStages = true;
     long timeStart = glutGet(GLUT_ELAPSED_TIME);
-    scene.render(image);
+    scene.build();
     long timeEnd = glutGet(GLUT_ELAPSED_TIME);
-    printf("Rendering time: %d milliseconds\n", (timeEnd - timeStart));
+    printf("Scene build time: %ld milliseconds\n", (timeEnd - timeStart));
 
-    // copy image to GPU as a texture
+    // the texture starts black and is filled by onIdle while the renderer works in the background
+    std::vector<vec4> image(windowWidth * windowHeight, vec4(0, 0, 0, 1));
     fullScreenTexturedQuad = new FullScreenTexturedQuad(windowWidth, windowHeight, image);
+    uploadTime = 0;
+    renderer.start(scene);
 
     // create program for the GPU
     gpuProgram.create(vertexSource, fragmentSource, "fragmentColor");
@@ -242,6 +173,64 @@ void onDisplay() {
 
 // Key of ASCII code pressed
 void onKeyboard(unsigned char key, int pX, int pY) {
+    if (key == 'b') {	// switch to the next intersection accelerator and render again
+        renderer.cancel();
+        scene.accelerator = (Accelerator)((scene.accelerator + 1) % nAccelerators);
+        uploadTime = 0;
+        renderer.start(scene);
+    }
+    if (key == 't') {	// toggle path tracing, which takes pathSamples samples per pixel
+        renderer.cancel();
+        scene.pathTracing = !scene.pathTracing;
+        scene.samplesPerPixel = (scene.adaptiveSampling || scene.pathTracing) ? pathSamples : 1;
+        uploadTime = 0;
+        renderer.start(scene);
+    }
+    if (key == 'w') {	// toggle the wavefront path tracer and render again
+        renderer.cancel();
+        scene.wavefront = !scene.wavefront;
+        uploadTime = 0;
+        renderer.start(scene);
+    }
+    if (key == 'i') {	// toggle the irradiance cache of the path tracer and render again
+        renderer.cancel();
+        scene.irradianceCaching = !scene.irradianceCaching;
+        uploadTime = 0;
+        renderer.start(scene);
+    }
+    if (key == 'a') {	// toggle adaptive anti-aliasing, up to pathSamples samples on the edges
+        renderer.cancel();
+        scene.adaptiveSampling = !scene.adaptiveSampling;
+        scene.samplesPerPixel = (scene.adaptiveSampling || scene.pathTracing) ? pathSamples : 1;
+        uploadTime = 0;
+        renderer.start(scene);
+    }
+    if (key == 'd') {	// toggle denoising of the final image
+        renderer.cancel();
+        scene.recordFeatures = !scene.recordFeatures;
+        uploadTime = 0;
+        renderer.start(scene);
+    }
+    if (key == 'p') {	// toggle packet tracing of primary rays and render again
+        renderer.cancel();
+        scene.usePackets = !scene.usePackets;
+        uploadTime = 0;
+        renderer.start(scene);
+    }
+    if (key == 'g') {	// toggle the shadow grids of the lights and render again
+        renderer.cancel();
+        scene.shadowGrids = !scene.shadowGrids;
+        uploadTime = 0;
+        renderer.start(scene);
+    }
+    if (key == 'm') {	// toggle the animation of the spheres and the camera, frames follow each other once rendered
+        animating = !animating;
+        if (animating) {
+            renderer.cancel();
+            uploadTime = 0;
+            renderer.start(scene);
+        }
+    }
 }
 
 // Key of ASCII code released
@@ -259,4 +248,23 @@ void onMouseMotion(int pX, int pY) {
 
 // Idle event indicating that some time elapsed: do animation here
 void onIdle() {
+    bool complete = renderer.complete();	// checked first, so the tiles of the last pass are already queued
+    std::vector<ProgressiveRenderer::Tile> tiles = renderer.takeFinished();
+    StageTimer timer(true);
+    for (const ProgressiveRenderer::Tile& tile : tiles) fullScreenTexturedQuad->LoadTile(tile);
+    timer.lap(uploadTime);
+    if (!tiles.empty()) glutPostRedisplay();
+    if (complete) {
+        RenderStats stats = scene.stats();
+        stats.uploadTime = uploadTime;
+        stats.print();
+        if (animating) {	// the BVH is refitted instead of being built again
+            scene.animate(0.05f);
+            long timeStart = glutGet(GLUT_ELAPSED_TIME);
+            int rebuilt = scene.update();
+            printf("BVH update time: %ld milliseconds, %d subtrees rebuilt\n", glutGet(GLUT_ELAPSED_TIME) - timeStart, rebuilt);
+            uploadTime = 0;
+            renderer.start(scene);
+        }
+    }
 }
\ No newline at end of file
@@ -0,0 +1,249 @@
+//=============================================================================================
+// Benchmark of the CPU ray tracer: renders fixed-seed scenes of Scene::build while sweeping the
+// sphere count, the resolution and the thread count. Reports rays/s, intersection tests per ray and
+// the thread scaling efficiency, and compares every image with a stored reference image.
+//=============================================================================================
+#include "raytracer.h"
+#include "imageio.h"
+#include <string.h>
+#if defined(_MSC_VER)
+#define strcasecmp _stricmp
+#endif
+
+struct Options {
+    int maxSpheres = 1000000;
+    int spheres = 10000;		// scene of the resolution and thread sweeps
+    int width = 0, height = 0;	// only resolution of the resolution sweep if not 0
+    int repeat = 3;				// renders per configuration, the fastest one is reported
+    unsigned int seed = 1;
+    Accelerator accelerator = BVH_TREE;
+    bool packets = true;
+    bool shadowGrid = false;
+    float smoothRatio = 0;		// part of the spheres made of gold or glass
+    bool sweepSpheres = true, sweepResolution = true, sweepThreads = true;
+    std::string referenceDir, json;
+    bool updateReferences = false;
+    float tolerance = 1e-3f;	// mean absolute error of the color channels
+};
+
+struct Config {
+    int spheres, width, height, threads;
+};
+
+struct Result {
+    Config config;
+    double buildTime, renderTime;	// milliseconds
+    RenderStats stats;
+    float error;					// mean absolute error to the reference, negative if not compared
+    bool passed;
+};
+
+void printUsage(const char * program) {
+    printf("Usage: %s [options]\n"
+           "  --sweep S              spheres, resolution, threads or all (default all)\n"
+           "  --max-spheres N        largest scene of the sphere sweep (default 1000000)\n"
+           "  --spheres N            scene of the resolution and thread sweeps (default 10000)\n"
+           "  --resolution WxH       render the resolution sweep at WxH only\n"
+           "  --repeat R             renders per configuration, the fastest is reported (default 3)\n"
+           "  --seed S               seed of the scene generator (default 1)\n"
+           "  --accel A              linear, bvh, simd, bins or bvh4 (default bvh)\n"
+           "  --no-packets           trace primary rays one by one\n"
+           "  --shadow-grid          answer the shadow rays from light-space occluder grids\n"
+           "  --smooth R             part of the spheres made of gold or glass (default 0)\n"
+           "  --reference-dir DIR    compare the images with DIR/<scene>.pfm\n"
+           "  --update-references    write the images to the reference directory instead\n"
+           "  --tolerance E          largest mean absolute error accepted (default 0.001)\n"
+           "  --json FILE            append one JSON record per configuration to FILE\n",
+           program);
+}
+
+bool parseOptions(int argc, char * argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        const char * arg = argv[i];
+        const char * value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        bool hasValue = true;
+        if (!strcmp(arg, "--no-packets")) { options.packets = false; hasValue = false; }
+        else if (!strcmp(arg, "--shadow-grid")) { options.shadowGrid = true; hasValue = false; }
+        else if (!strcmp(arg, "--update-references")) { options.updateReferences = true; hasValue = false; }
+        else if (!value) { printf("Unknown option or missing value: %s\n", arg); return false; }
+        else if (!strcmp(arg, "--max-spheres")) options.maxSpheres = atoi(value);
+        else if (!strcmp(arg, "--spheres")) options.spheres = atoi(value);
+        else if (!strcmp(arg, "--repeat")) options.repeat = atoi(value);
+        else if (!strcmp(arg, "--resolution")) {
+            if (sscanf(value, "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0) {
+                printf("Invalid resolution %s\n", value);
+                return false;
+            }
+        }
+        else if (!strcmp(arg, "--seed")) options.seed = (unsigned int)strtoul(value, nullptr, 10);
+        else if (!strcmp(arg, "--reference-dir")) options.referenceDir = value;
+        else if (!strcmp(arg, "--smooth")) options.smoothRatio = (float)atof(value);
+        else if (!strcmp(arg, "--tolerance")) options.tolerance = (float)atof(value);
+        else if (!strcmp(arg, "--json")) options.json = value;
+        else if (!strcmp(arg, "--sweep")) {
+            bool all = !strcmp(value, "all");
+            options.sweepSpheres = all || !strcmp(value, "spheres");
+            options.sweepResolution = all || !strcmp(value, "resolution");
+            options.sweepThreads = all || !strcmp(value, "threads");
+            if (!options.sweepSpheres && !options.sweepResolution && !options.sweepThreads) { printf("Unknown sweep %s\n", value); return false; }
+        }
+        else if (!strcmp(arg, "--accel")) {
+            int a = 0;
+            while (a < nAccelerators && strcasecmp(value, acceleratorNames[a])) a++;
+            if (a == nAccelerators) { printf("Unknown accelerator %s\n", value); return false; }
+            options.accelerator = (Accelerator)a;
+        }
+        else { printf("Unknown option %s\n", arg); return false; }
+        if (hasValue) i++;
+    }
+    if (options.maxSpheres < 0 || options.spheres < 0 || options.repeat <= 0 || options.tolerance < 0 ||
+        options.smoothRatio < 0 || options.smoothRatio > 1) {
+        printf("Invalid option value\n");
+        return false;
+    }
+    if (options.updateReferences && options.referenceDir.empty()) {
+        printf("--update-references needs --reference-dir\n");
+        return false;
+    }
+    return true;
+}
+
+double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// the image depends on the scene and the resolution only, every thread count is compared with the same reference
+std::string referencePath(const Options& options, const Config& config) {
+    char name[128];
+    if (options.smoothRatio > 0)
+        snprintf(name, sizeof(name), "/spheres%d_seed%u_smooth%g_%dx%d.pfm", config.spheres, options.seed, options.smoothRatio, config.width, config.height);
+    else snprintf(name, sizeof(name), "/spheres%d_seed%u_%dx%d.pfm", config.spheres, options.seed, config.width, config.height);
+    return options.referenceDir + name;
+}
+
+float meanAbsoluteError(const std::vector<vec4>& image, const std::vector<vec4>& reference) {
+    double sum = 0;
+    for (size_t i = 0; i < image.size(); i++)
+        for (int k = 0; k < 3; k++) sum += fabsf(image[i][k] - reference[i][k]);
+    return (float)(sum / (3.0 * image.size()));
+}
+
+Result run(const Options& options, const Config& config) {
+    Result result = { config, 0, FLT_MAX, RenderStats(), -1, true };
+    Scene scene;
+    scene.setResolution(config.width, config.height);
+    scene.setThreads(config.threads);
+    scene.accelerator = options.accelerator;
+    scene.usePackets = options.packets;
+    scene.shadowGrids = options.shadowGrid;
+    scene.smoothRatio = options.smoothRatio;
+
+    srand(options.seed);
+    auto buildStart = std::chrono::steady_clock::now();
+    scene.build(config.spheres);
+    result.buildTime = millisecondsSince(buildStart);
+
+    std::vector<vec4> image(config.width * config.height);
+    for (int r = 0; r < options.repeat; r++) {
+        scene.resetStats();
+        auto renderStart = std::chrono::steady_clock::now();
+        scene.render(image);
+        result.renderTime = std::min(result.renderTime, millisecondsSince(renderStart));
+    }
+    result.stats = scene.stats();
+
+    if (options.referenceDir.empty()) return result;
+    std::string path = referencePath(options, config);
+    if (options.updateReferences) {
+        result.passed = writePFM(path, image, config.width, config.height);
+        return result;
+    }
+    std::vector<vec4> reference;
+    int width, height;
+    if (!readPFM(path, reference, width, height)) {
+        printf("Missing reference %s\n", path.c_str());
+        result.passed = false;
+    } else if (width != config.width || height != config.height) {
+        printf("Reference %s is %dx%d\n", path.c_str(), width, height);
+        result.passed = false;
+    } else {
+        result.error = meanAbsoluteError(image, reference);
+        result.passed = result.error <= options.tolerance;
+    }
+    return result;
+}
+
+void report(const Options& options, const char * sweep, const Result& result, double efficiency) {
+    const Config& c = result.config;
+    double seconds = result.renderTime / 1000.0;
+    double testsPerRay = result.stats.rays() ? (double)result.stats.intersectionTests / result.stats.rays() : 0;
+    printf("%-10s %8d %5dx%-5d %3d %10.1f %10.1f %8.2f %8.2f %8.2f", sweep, c.spheres, c.width, c.height, c.threads,
+           result.buildTime, result.renderTime, result.stats.primaryRays / seconds / 1e6, result.stats.rays() / seconds / 1e6, testsPerRay);
+    if (efficiency >= 0) printf(" %6.2f", efficiency); else printf(" %6s", "-");
+    if (result.error >= 0) printf(" %9.2e %s", result.error, result.passed ? "ok" : "FAILED");
+    else if (!result.passed) printf(" %9s FAILED", "-");
+    printf("\n");
+    fflush(stdout);
+
+    if (options.json.empty()) return;
+    FILE * json = fopen(options.json.c_str(), "a");
+    if (!json) {
+        printf("%s cannot be written\n", options.json.c_str());
+        return;
+    }
+    fprintf(json, "{\"sweep\": \"%s\", \"spheres\": %d, \"width\": %d, \"height\": %d, \"threads\": %d, \"seed\": %u, "
+                  "\"accelerator\": \"%s\", \"packets\": %s, \"shadow_grid\": %s, \"build_ms\": %.3f, \"render_ms\": %.3f, "
+                  "\"primary_rays\": %llu, \"shadow_rays\": %llu, \"intersection_tests\": %llu, \"nodes_visited\": %llu, \"rays_per_s\": %.0f, "
+                  "\"tests_per_ray\": %.3f, \"efficiency\": %.3f, \"error\": %g, \"passed\": %s}\n",
+            sweep, c.spheres, c.width, c.height, c.threads, options.seed, acceleratorNames[options.accelerator],
+            options.packets ? "true" : "false", options.shadowGrid ? "true" : "false", result.buildTime, result.renderTime,
+            (unsigned long long)result.stats.primaryRays, (unsigned long long)result.stats.shadowRays,
+            (unsigned long long)result.stats.intersectionTests, (unsigned long long)result.stats.nodesVisited, result.stats.rays() / seconds, testsPerRay,
+            efficiency, result.error, result.passed ? "true" : "false");
+    fclose(json);
+}
+
+int main(int argc, char * argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+    printf("%s accelerator%s%s, seed %u, %d hardware threads, best of %d renders\n", acceleratorNames[options.accelerator],
+           options.packets ? " with packets" : "", options.shadowGrid ? ", shadow grids" : "", options.seed, hardwareThreads, options.repeat);
+    printf("%-10s %8s %11s %3s %10s %10s %8s %8s %8s %6s %9s\n", "sweep", "spheres", "resolution", "thr",
+           "build ms", "render ms", "Mprim/s", "Mrays/s", "tests/r", "eff", "error");
+
+    bool passed = true;
+    if (options.sweepSpheres) {
+        for (int spheres = 100; spheres <= options.maxSpheres; spheres *= 10) {
+            Result result = run(options, { spheres, windowWidth, windowHeight, hardwareThreads });
+            report(options, "spheres", result, -1);
+            passed = passed && result.passed;
+        }
+    }
+    if (options.sweepResolution) {
+        std::vector<std::pair<int, int>> resolutions = { { 256, 256 }, { windowWidth, windowHeight }, { 1280, 720 }, { 1920, 1080 } };
+        if (options.width > 0) resolutions = { { options.width, options.height } };
+        for (const auto& resolution : resolutions) {
+            Result result = run(options, { options.spheres, resolution.first, resolution.second, hardwareThreads });
+            report(options, "resolution", result, -1);
+            passed = passed && result.passed;
+        }
+    }
+    if (options.sweepThreads) {	// efficiency: speedup over one thread divided by the thread count
+        std::vector<int> threadCounts;	// 1, 2, 4, ... and the hardware thread count
+        for (int threads = 1; threads < hardwareThreads; threads *= 2) threadCounts.push_back(threads);
+        threadCounts.push_back(hardwareThreads);
+        double singleThreadTime = 0;
+        for (int threads : threadCounts) {
+            Result result = run(options, { options.spheres, windowWidth, windowHeight, threads });
+            if (threads == 1) singleThreadTime = result.renderTime;
+            report(options, "threads", result, singleThreadTime / result.renderTime / threads);
+            passed = passed && result.passed;
+        }
+    }
+    if (!options.referenceDir.empty() && !options.updateReferences) printf(passed ? "All images match the references\n" : "Image regression FAILED\n");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+//=============================================================================================
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) for images of few samples per pixel.
+// The 5x5 B3 spline kernel is applied with holes of 1, 2, 4, ... pixels, every tap is weighted down
+// by the difference of its color, normal and depth to the center pixel, so the noise is smoothed
+// inside surfaces while silhouettes and shadow edges stay sharp.
+//=============================================================================================
+#pragma once
+#include "raytracer.h"	// framework.h has no include guard, it is included once through raytracer.h
+
+struct DenoiseSettings {
+    int iterations = 5;			// filter footprints of 5, 9, 17, 33 and 65 pixels
+    float sigmaColor = 1.0f;	// halved in every iteration, as the noise is already reduced
+    float sigmaNormal = 16;		// exponent of the cosine between the normals
+    float sigmaDepth = 0.1f;	// depth difference accepted per pixel of distance
+};
+
+// Filters image in place on the threads of pool. normals and depths are the features recorded by the
+// scene (Scene::recordFeatures), rows of the image are the tasks of an iteration.
+inline void denoise(std::vector<vec4>& image, const std::vector<vec3>& normals, const std::vector<float>& depths,
+                    int width, int height, ThreadPool& pool, const DenoiseSettings& settings = DenoiseSettings()) {
+    static const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+    std::vector<vec4> buffer(image.size());
+    std::vector<vec4> * src = &image, * dst = &buffer;
+    float sigmaColor = settings.sigmaColor;
+    for (int iteration = 0; iteration < settings.iterations; iteration++) {
+        int holes = 1 << iteration;
+        float colorScale = -1 / (sigmaColor * sigmaColor), depthScale = -1 / (settings.sigmaDepth * holes);
+        const vec4 * in = &(*src)[0];
+        vec4 * out = &(*dst)[0];
+        pool.run(height, [&](int Y, int) {
+            for (int X = 0; X < width; X++) {
+                int p = Y * width + X;
+                const vec3& np = normals[p];
+                float zp = depths[p];
+                bool missed = (zp == 0);
+#if defined(__SSE2__) || defined(_M_X64)
+                __m128 cp = _mm_loadu_ps(&in[p].x), sum = _mm_setzero_ps();
+#else
+                vec4 cp = in[p], sum;
+#endif
+                float weightSum = 0;
+                for (int j = -2; j <= 2; j++) {
+                    int QY = Y + j * holes;
+                    if (QY < 0 || QY >= height) continue;
+                    for (int i = -2; i <= 2; i++) {
+                        int QX = X + i * holes;
+                        if (QX < 0 || QX >= width) continue;
+                        int q = QY * width + QX;
+#if defined(__SSE2__) || defined(_M_X64)
+                        __m128 cq = _mm_loadu_ps(&in[q].x), d = _mm_sub_ps(cq, cp);
+                        d = _mm_mul_ps(d, d);
+                        d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(2, 3, 0, 1)));
+                        float colorDistance = _mm_cvtss_f32(_mm_add_ss(d, _mm_movehl_ps(d, d)));
+#else
+                        vec4 cq = in[q], d = cq - cp;
+                        float colorDistance = d.x * d.x + d.y * d.y + d.z * d.z + d.w * d.w;
+#endif
+                        float w = kernel[j + 2] * kernel[i + 2] * expf(colorDistance * colorScale);
+                        if (q != p) {
+                            if (missed != (depths[q] == 0)) w = 0;	// the sky is not mixed with surfaces
+                            else if (!missed) {
+                                w *= powf(fmaxf(dot(np, normals[q]), 0.0f), settings.sigmaNormal);
+                                w *= expf(fabsf(zp - depths[q]) * depthScale);
+                            }
+                        }
+#if defined(__SSE2__) || defined(_M_X64)
+                        sum = _mm_add_ps(sum, _mm_mul_ps(cq, _mm_set1_ps(w)));
+#else
+                        sum = sum + cq * w;
+#endif
+                        weightSum += w;
+                    }
+                }
+#if defined(__SSE2__) || defined(_M_X64)
+                _mm_storeu_ps(&out[p].x, _mm_mul_ps(sum, _mm_set1_ps(1 / weightSum)));	// the center has weight 9/64 at least
+#else
+                out[p] = sum / weightSum;
+#endif
+            }
+        });
+        std::swap(src, dst);
+        sigmaColor *= 0.5f;
+    }
+    if (src != &image) image.swap(buffer);
+}
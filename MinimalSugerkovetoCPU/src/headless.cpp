@@ -0,0 +1,263 @@
+//=============================================================================================
+// Headless batch renderer: builds the scene of the ray-tracing sample and renders it without a
+// window or OpenGL context, writing the image to PPM/PFM files and the timings to a JSON record.
+//=============================================================================================
+#include "raytracer.h"
+#include "imageio.h"
+#include "denoiser.h"
+#include "meshio.h"
+#include "sceneio.h"
+#include <string.h>
+#if defined(_MSC_VER)
+#define strcasecmp _stricmp
+#endif
+
+struct Options {
+    int spheres = 100, instances = 0, cluster = 100, lights = 1, frames = 0, width = windowWidth, height = windowHeight, samples = 1, threads = 0;
+    unsigned int seed = 1;		// rand() starts from seed 1 in the GLUT program as well, also seeds the samplers
+    Accelerator accelerator = BVH_TREE;
+    bool packets = true;
+    bool shadowGrid = false;
+    bool pathTracing = false;
+    bool wavefront = false;
+    bool irradianceCache = false;
+    float accuracy = 0.5f;
+    bool adaptive = false;
+    bool denoise = false;
+    bool fullRebuild = false;	// build the BVH again every frame instead of refitting it
+    int minSamples = 4;
+    float contrast = 0.1f;
+    float smoothRatio = 0;
+    int maxDepth = 5, rayBudget = 16;
+    SamplerType sampler = SOBOL_SAMPLER;
+    bool stats = false;
+    std::string ppm, pfm, json, heatmap, mesh, sceneFile, saveScene;
+};
+
+void printUsage(const char * program) {
+    printf("Usage: %s [options]\n"
+           "  --spheres N       number of spheres (default 100)\n"
+           "  --width W         image width (default %d)\n"
+           "  --height H        image height (default %d)\n"
+           "  --spp S           samples per pixel (default 1)\n"
+           "  --threads T       render threads, 0: one per hardware thread (default 0)\n"
+           "  --seed S          seed of the scene generator (default 1)\n"
+           "  --accel A         linear, bvh, simd, bins or bvh4 (default bvh)\n"
+           "  --no-packets      trace primary rays one by one\n"
+           "  --shadow-grid     answer the shadow rays from light-space occluder grids\n"
+           "  --mesh FILE       add the triangles of an .obj or .ply file, fitted into the sphere cube\n"
+           "  --instances N     add N randomly placed instances of the mesh or of a sphere cluster\n"
+           "  --cluster S       spheres of the instanced cluster (default 100)\n"
+           "  --lights L        directional lights, the ones after the first from random directions (default 1)\n"
+           "  --scene FILE      load a binary scene file instead of building the scene\n"
+           "  --save-scene FILE write the scene with its BVH to a binary scene file\n"
+           "  --frames F        animate the spheres, instances and camera for F more frames\n"
+           "  --full-rebuild    build the BVH of every frame from scratch instead of refitting it\n"
+           "  --smooth R        part of the spheres made of gold or glass (default 0)\n"
+           "  --depth D         reflection / refraction levels (default 5)\n"
+           "  --ray-budget B    secondary rays per primary ray, at most %d (default 16)\n"
+           "  --adaptive        start with --min-spp samples, go up to --spp where the contrast is high\n"
+           "  --min-spp S       first samples of adaptive anti-aliasing (default 4)\n"
+           "  --contrast C      contrast threshold of adaptive anti-aliasing (default 0.1)\n"
+           "  --denoise         filter the image guided by the normals and depths of the primary hits\n"
+           "  --path            Monte Carlo path tracing with --spp samples per pixel\n"
+           "  --wavefront       trace the paths in waves through structure of arrays queues\n"
+           "  --irradiance-cache take the first diffuse bounce of the paths from an irradiance cache\n"
+           "  --ic-accuracy A   extrapolation error accepted by the irradiance cache (default 0.5)\n"
+           "  --sampler S       random, stratified or sobol samples of the pixels and paths (default sobol)\n"
+           "  --ppm FILE        write an 8 bit PPM image\n"
+           "  --pfm FILE        write a float PFM image\n"
+           "  --json FILE       write the timing record to FILE instead of stdout\n"
+           "  --stats           time the render stages and print the ray statistics\n"
+           "  --heatmap FILE    write the work spent on each pixel as a PPM image\n",
+           program, windowWidth, windowHeight, Scene::maxRayBudget);
+}
+
+bool parseOptions(int argc, char * argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        const char * arg = argv[i];
+        const char * value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        bool hasValue = true;
+        if (!strcmp(arg, "--no-packets")) { options.packets = false; hasValue = false; }
+        else if (!strcmp(arg, "--shadow-grid")) { options.shadowGrid = true; hasValue = false; }
+        else if (!strcmp(arg, "--stats")) { options.stats = true; hasValue = false; }
+        else if (!strcmp(arg, "--path")) { options.pathTracing = true; hasValue = false; }
+        else if (!strcmp(arg, "--wavefront")) { options.wavefront = true; hasValue = false; }
+        else if (!strcmp(arg, "--irradiance-cache")) { options.irradianceCache = true; hasValue = false; }
+        else if (!strcmp(arg, "--adaptive")) { options.adaptive = true; hasValue = false; }
+        else if (!strcmp(arg, "--denoise")) { options.denoise = true; hasValue = false; }
+        else if (!strcmp(arg, "--full-rebuild")) { options.fullRebuild = true; hasValue = false; }
+        else if (!value) { printf("Unknown option or missing value: %s\n", arg); return false; }
+        else if (!strcmp(arg, "--spheres")) options.spheres = atoi(value);
+        else if (!strcmp(arg, "--instances")) options.instances = atoi(value);
+        else if (!strcmp(arg, "--cluster")) options.cluster = atoi(value);
+        else if (!strcmp(arg, "--lights")) options.lights = atoi(value);
+        else if (!strcmp(arg, "--frames")) options.frames = atoi(value);
+        else if (!strcmp(arg, "--width")) options.width = atoi(value);
+        else if (!strcmp(arg, "--height")) options.height = atoi(value);
+        else if (!strcmp(arg, "--spp")) options.samples = atoi(value);
+        else if (!strcmp(arg, "--threads")) options.threads = atoi(value);
+        else if (!strcmp(arg, "--seed")) options.seed = (unsigned int)strtoul(value, nullptr, 10);
+        else if (!strcmp(arg, "--ppm")) options.ppm = value;
+        else if (!strcmp(arg, "--pfm")) options.pfm = value;
+        else if (!strcmp(arg, "--json")) options.json = value;
+        else if (!strcmp(arg, "--heatmap")) options.heatmap = value;
+        else if (!strcmp(arg, "--mesh")) options.mesh = value;
+        else if (!strcmp(arg, "--scene")) options.sceneFile = value;
+        else if (!strcmp(arg, "--save-scene")) options.saveScene = value;
+        else if (!strcmp(arg, "--min-spp")) options.minSamples = atoi(value);
+        else if (!strcmp(arg, "--contrast")) options.contrast = (float)atof(value);
+        else if (!strcmp(arg, "--smooth")) options.smoothRatio = (float)atof(value);
+        else if (!strcmp(arg, "--depth")) options.maxDepth = atoi(value);
+        else if (!strcmp(arg, "--ray-budget")) options.rayBudget = atoi(value);
+        else if (!strcmp(arg, "--ic-accuracy")) options.accuracy = (float)atof(value);
+        else if (!strcmp(arg, "--accel")) {
+            int a = 0;
+            while (a < nAccelerators && strcasecmp(value, acceleratorNames[a])) a++;
+            if (a == nAccelerators) { printf("Unknown accelerator %s\n", value); return false; }
+            options.accelerator = (Accelerator)a;
+        }
+        else if (!strcmp(arg, "--sampler")) {
+            int t = 0;
+            while (t < nSamplerTypes && strcasecmp(value, samplerNames[t])) t++;
+            if (t == nSamplerTypes) { printf("Unknown sampler %s\n", value); return false; }
+            options.sampler = (SamplerType)t;
+        }
+        else { printf("Unknown option %s\n", arg); return false; }
+        if (hasValue) i++;
+    }
+    if (options.spheres < 0 || options.instances < 0 || options.cluster < 0 || options.lights <= 0 || options.frames < 0 || options.width <= 0 || options.height <= 0 || options.samples <= 0 || options.threads < 0 ||
+        options.smoothRatio < 0 || options.smoothRatio > 1 || options.maxDepth < 0 || options.rayBudget < 0 || options.rayBudget > Scene::maxRayBudget ||
+        options.minSamples <= 0 || options.contrast < 0 || options.accuracy <= 0) {
+        printf("Invalid option value\n");
+        return false;
+    }
+    return true;
+}
+
+double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char * argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    Scene scene;
+    scene.setResolution(options.width, options.height);
+    scene.samplesPerPixel = options.samples;
+    scene.nThreads = options.threads;
+    scene.accelerator = options.accelerator;
+    scene.usePackets = options.packets;
+    scene.shadowGrids = options.shadowGrid;
+    scene.pathTracing = options.pathTracing;
+    scene.wavefront = options.wavefront;
+    scene.irradianceCaching = options.irradianceCache;
+    scene.irradiance.accuracy = options.accuracy;
+    scene.smoothRatio = options.smoothRatio;
+    scene.adaptiveSampling = options.adaptive;
+    scene.recordFeatures = options.denoise;
+    scene.minSamples = options.minSamples;
+    scene.contrastThreshold = options.contrast;
+    scene.maxDepth = options.maxDepth;
+    scene.rayBudget = options.rayBudget;
+    scene.samplerType = options.sampler;
+    scene.seed = options.seed;
+    scene.timeStages = options.stats;
+    scene.recordCosts = !options.heatmap.empty();
+
+    srand(options.seed);
+    double buildTime = 0, loadTime = 0;
+    size_t triangles = 0;
+    if (!options.sceneFile.empty()) {	// the options of the scene content are ignored
+        auto loadStart = std::chrono::steady_clock::now();
+        SceneFileInfo info;
+        if (!SceneFile::load(options.sceneFile, scene, &info)) return 1;
+        loadTime = millisecondsSince(loadStart);
+        options.spheres = (int)info.spheres;
+        options.instances = 0;
+        triangles = info.triangles;
+        if (!info.prebuiltBVH) printf("%s has no BVH, it was built\n", options.sceneFile.c_str());
+    } else {
+        auto buildStart = std::chrono::steady_clock::now();
+        scene.build(options.spheres);
+        buildTime = millisecondsSince(buildStart);
+    }
+
+    Mesh * mesh = nullptr;
+    if (!options.mesh.empty() && options.sceneFile.empty()) {
+        auto loadStart = std::chrono::steady_clock::now();
+        mesh = scene.make<Mesh>();
+        if (!loadMesh(options.mesh, *mesh, scene.threadPool())) return 1;
+        mesh->fit(vec3(0, 0, 0), 1);
+        loadTime = millisecondsSince(loadStart);
+    }
+    if (mesh) triangles = mesh->faceCount();
+    if (mesh || (options.instances > 0 && options.sceneFile.empty())) {	// the instances are scaled to the size of the spheres of build
+        auto buildStart = std::chrono::steady_clock::now();
+        if (options.instances == 0) scene.addMesh(mesh);
+        else {
+            Model * model = mesh ? scene.addModel() : scene.addSphereCluster(options.cluster);
+            if (mesh) scene.addMesh(mesh, model);
+            scene.scatter(model, options.instances, 0.2f);
+        }
+        scene.commit();
+        buildTime += millisecondsSince(buildStart);
+    }
+    if (options.sceneFile.empty()) scene.addLights(options.lights - 1);
+
+    if (!options.saveScene.empty() && !SceneFile::save(options.saveScene, scene)) return 1;
+
+    std::vector<vec4> image(options.width * options.height);
+    auto renderStart = std::chrono::steady_clock::now();
+    scene.render(image);
+    double renderTime = millisecondsSince(renderStart);
+
+    double updateTime = 0, frameRenderTime = 0;	// sums over the animated frames
+    int rebuiltSubtrees = 0;
+    for (int frame = 0; frame < options.frames; frame++) {
+        scene.animate(0.05f);
+        auto updateStart = std::chrono::steady_clock::now();
+        if (options.fullRebuild) scene.commit();
+        else rebuiltSubtrees += scene.update();
+        updateTime += millisecondsSince(updateStart);
+        renderStart = std::chrono::steady_clock::now();
+        scene.render(image);
+        frameRenderTime += millisecondsSince(renderStart);
+    }
+
+    double denoiseTime = 0;
+    if (options.denoise) {
+        auto denoiseStart = std::chrono::steady_clock::now();
+        denoise(image, scene.normals, scene.depths, options.width, options.height, scene.threadPool());
+        denoiseTime = millisecondsSince(denoiseStart);
+    }
+
+    if (!options.ppm.empty() && !writePPM(options.ppm, image, options.width, options.height)) return 1;
+    if (!options.pfm.empty() && !writePFM(options.pfm, image, options.width, options.height)) return 1;
+    if (!options.heatmap.empty() && !writePPM(options.heatmap, heatmap(scene.costs), options.width, options.height)) return 1;
+    if (options.stats) scene.stats().print();
+
+    RenderStats stats = scene.stats();
+    double primaryRays = (double)stats.primaryRays;
+    FILE * json = options.json.empty() ? stdout : fopen(options.json.c_str(), "w");
+    if (!json) {
+        printf("%s cannot be written\n", options.json.c_str());
+        return 1;
+    }
+    fprintf(json, "{\"spheres\": %d, \"triangles\": %zu, \"instances\": %d, \"frames\": %d, \"width\": %d, \"height\": %d, \"spp\": %d, \"threads\": %d, \"seed\": %u, "
+                  "\"accelerator\": \"%s\", \"packets\": %s, \"sampler\": \"%s\", \"load_ms\": %.3f, \"build_ms\": %.3f, \"render_ms\": %.3f, \"denoise_ms\": %.3f, "
+                  "\"frame_update_ms\": %.3f, \"frame_render_ms\": %.3f, \"rebuilt_subtrees\": %d, \"primary_rays_per_s\": %.0f, "
+                  "\"shadow_rays\": %llu, \"secondary_rays\": %llu, \"intersection_tests\": %llu, \"nodes_visited\": %llu, \"irradiance_records\": %zu}\n",
+            options.spheres, triangles, options.instances, options.frames, options.width, options.height, options.samples, scene.pool->size(), options.seed,
+            acceleratorNames[options.accelerator], options.packets ? "true" : "false",
+            options.pathTracing ? samplerNames[options.sampler] : "none", loadTime, buildTime, renderTime, denoiseTime,
+            options.frames ? updateTime / options.frames : 0.0, options.frames ? frameRenderTime / options.frames : 0.0, rebuiltSubtrees,
+            primaryRays / ((renderTime + frameRenderTime) / 1000.0), (unsigned long long)stats.shadowRays, (unsigned long long)stats.secondaryRays,
+            (unsigned long long)stats.intersectionTests, (unsigned long long)stats.nodesVisited, scene.irradiance.size());
+    if (json != stdout) fclose(json);
+    return 0;
+}
@@ -0,0 +1,75 @@
+//=============================================================================================
+// Image files of the headless renderer. Images are width * height vec4 pixels, row 0 at the bottom
+// as in the OpenGL texture.
+//=============================================================================================
+#pragma once
+#include "raytracer.h"	// framework.h has no include guard, it is included once through raytracer.h
+
+// binary 8 bit PPM, clamped to [0, 1] like the window shows it, rows written top to bottom
+inline bool writePPM(const std::string& pathname, const std::vector<vec4>& image, int width, int height) {
+    FILE * file = fopen(pathname.c_str(), "wb");
+    if (!file) {
+        printf("%s cannot be written\n", pathname.c_str());
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    std::vector<unsigned char> row(width * 3);
+    for (int Y = height - 1; Y >= 0; Y--) {
+        for (int X = 0; X < width; X++) {
+            const vec4& c = image[Y * width + X];
+            for (int k = 0; k < 3; k++) row[X * 3 + k] = (unsigned char)(fminf(fmaxf(c[k], 0.0f), 1.0f) * 255.0f + 0.5f);
+        }
+        fwrite(&row[0], 1, row.size(), file);
+    }
+    fclose(file);
+    return true;
+}
+
+// little endian RGB float PFM, which stores its rows bottom to top like the image
+inline bool writePFM(const std::string& pathname, const std::vector<vec4>& image, int width, int height) {
+    FILE * file = fopen(pathname.c_str(), "wb");
+    if (!file) {
+        printf("%s cannot be written\n", pathname.c_str());
+        return false;
+    }
+    fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+    std::vector<float> row(width * 3);
+    for (int Y = 0; Y < height; Y++) {
+        for (int X = 0; X < width; X++)
+            for (int k = 0; k < 3; k++) row[X * 3 + k] = image[Y * width + X][k];
+        fwrite(&row[0], sizeof(float), row.size(), file);
+    }
+    fclose(file);
+    return true;
+}
+
+// reads a PFM written by writePFM (RGB, little endian), false if the file is missing or has another format
+inline bool readPFM(const std::string& pathname, std::vector<vec4>& image, int& width, int& height) {
+    FILE * file = fopen(pathname.c_str(), "rb");
+    if (!file) return false;
+    float scale = 0;
+    bool ok = fscanf(file, "PF %d %d %f", &width, &height, &scale) == 3 && scale < 0 && width > 0 && height > 0 && fgetc(file) == '\n';
+    if (ok) {
+        image.resize(width * height);
+        std::vector<float> row(width * 3);
+        for (int Y = 0; Y < height && ok; Y++) {
+            ok = fread(&row[0], sizeof(float), row.size(), file) == row.size();
+            for (int X = 0; X < width; X++) image[Y * width + X] = vec4(row[X * 3], row[X * 3 + 1], row[X * 3 + 2], 1);
+        }
+    }
+    fclose(file);
+    if (!ok) printf("%s is not an RGB little endian PFM\n", pathname.c_str());
+    return ok;
+}
+
+// per-pixel cost mapped to a blue - green - red ramp, red is the most expensive pixel
+inline std::vector<vec4> heatmap(const std::vector<float>& costs) {
+    float maxCost = 0;
+    for (float cost : costs) maxCost = fmaxf(maxCost, cost);
+    std::vector<vec4> image(costs.size());
+    for (size_t i = 0; i < costs.size(); i++) {
+        float h = (maxCost > 0) ? costs[i] / maxCost : 0;
+        image[i] = (h < 0.5f) ? vec4(0, 2 * h, 1 - 2 * h, 1) : vec4(2 * h - 1, 2 - 2 * h, 0, 1);
+    }
+    return image;
+}
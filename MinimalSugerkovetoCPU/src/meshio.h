@@ -0,0 +1,452 @@
+//=============================================================================================
+// Triangle mesh files: Wavefront OBJ and PLY (ASCII or binary little endian). The file is memory
+// mapped instead of read, and OBJ files and binary PLY files are parsed in parallel on a thread pool:
+// the text is cut into chunks at line boundaries, a counting pass gives every chunk its first vertex and
+// face, then the chunks are parsed into their place of the arrays independently.
+//=============================================================================================
+#pragma once
+#include "raytracer.h"	// framework.h has no include guard, it is included once through raytracer.h
+#include <ctype.h>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// read-only mapping of a whole file, unmapped by the destructor
+class MappedFile {
+    const char * bytes = nullptr;
+    size_t length = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+public:
+    MappedFile() { }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& pathname) {
+#if defined(_WIN32)
+        file = CreateFileA(pathname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) return false;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) return false;
+        bytes = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        length = bytes ? (size_t)fileSize.QuadPart : 0;
+#else
+        int fd = ::open(pathname.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void * address = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                bytes = (const char *)address;
+                length = (size_t)info.st_size;
+                madvise(address, length, MADV_WILLNEED);
+            }
+        }
+        close(fd);	// the mapping stays valid
+#endif
+        return bytes != nullptr;
+    }
+
+    ~MappedFile() {
+#if defined(_WIN32)
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (bytes) munmap((void *)bytes, length);
+#endif
+    }
+
+    const char * data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Number parsers of the mapped text, they never read at or beyond end and advance p past the number.
+// Much faster than strtof, which also honours the locale and needs a terminating zero.
+inline void skipBlanks(const char *& p, const char * end) { while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++; }
+inline void skipLine(const char *& p, const char * end) {
+    const char * newline = (const char *)memchr(p, '\n', end - p);
+    p = newline ? newline + 1 : end;
+}
+
+inline bool parseInt(const char *& p, const char * end, long long& value) {
+    skipBlanks(p, end);
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    if (p == end || *p < '0' || *p > '9') return false;
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+    if (negative) value = -value;
+    return true;
+}
+
+inline bool parseFloat(const char *& p, const char * end, float& value) {
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                      1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    skipBlanks(p, end);
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    uint64_t mantissa = 0;
+    int exponent = 0, digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+        if (mantissa < 100000000000000000ULL) mantissa = mantissa * 10 + (*p - '0');
+        else exponent++;	// beyond the precision of a double
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+            if (mantissa < 100000000000000000ULL) { mantissa = mantissa * 10 + (*p - '0'); exponent--; }
+        }
+    }
+    if (digits == 0) return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        long long e;
+        if (!parseInt(p, end, e)) return false;
+        exponent += (int)std::max(-1000LL, std::min(1000LL, e));
+    }
+    double v = (double)mantissa;
+    while (exponent > 22) { v *= 1e22; exponent -= 22; }
+    while (exponent < -22) { v /= 1e22; exponent += 22; }
+    v = (exponent >= 0) ? v * powers[exponent] : v / powers[-exponent];
+    value = (float)(negative ? -v : v);
+    return true;
+}
+
+// Cuts [begin, end) into about nChunks pieces starting at line beginnings, at least minChunk bytes each.
+inline std::vector<const char *> splitLines(const char * begin, const char * end, int nChunks, size_t minChunk = 1 << 16) {
+    std::vector<const char *> bounds(1, begin);
+    size_t chunk = std::max(minChunk, (size_t)(end - begin) / std::max(nChunks, 1) + 1);
+    while (end - bounds.back() > (ptrdiff_t)chunk) {
+        const char * p = bounds.back() + chunk;
+        skipLine(p, end);
+        if (p == end) break;
+        bounds.push_back(p);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+// OBJ: "v x y z" vertices and "f" faces of 1-based or negative (relative) indices, "v/t/n" references
+// use the vertex only. Polygons are triangulated as fans, all other statements are ignored.
+inline bool loadOBJ(const MappedFile& file, Mesh& mesh, ThreadPool& pool) {
+    std::vector<const char *> bounds = splitLines(file.data(), file.data() + file.size(), pool.size() * 4);
+    int nChunks = (int)bounds.size() - 1;
+    std::vector<size_t> firstVertex(nChunks + 1, 0), firstFace(nChunks + 1, 0);
+    pool.run(nChunks, [&](int chunk, int) {	// counting pass
+        size_t nVertices = 0, nFaces = 0;
+        const char * end = bounds[chunk + 1];
+        for (const char * p = bounds[chunk]; p < end; skipLine(p, end)) {
+            skipBlanks(p, end);
+            if (end - p < 2 || (p[1] != ' ' && p[1] != '\t')) continue;
+            if (p[0] == 'v') nVertices++;
+            else if (p[0] == 'f') {
+                int corners = 0;
+                for (p++;;) {
+                    skipBlanks(p, end);
+                    if (p == end || *p == '\n' || *p == '#') break;
+                    corners++;
+                    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+                }
+                if (corners > 2) nFaces += corners - 2;
+            }
+        }
+        firstVertex[chunk + 1] = nVertices;
+        firstFace[chunk + 1] = nFaces;
+    });
+    for (int chunk = 0; chunk < nChunks; chunk++) {
+        firstVertex[chunk + 1] += firstVertex[chunk];
+        firstFace[chunk + 1] += firstFace[chunk];
+    }
+    size_t nVertices = firstVertex[nChunks], nFaces = firstFace[nChunks];
+    if (nVertices >= (1u << 31) || nFaces >= (1u << 28)) {
+        printf("%zu vertices and %zu faces are too many\n", nVertices, nFaces);
+        return false;
+    }
+    mesh.vertices.resize(nVertices);
+    mesh.indices.resize(nFaces * 3);
+
+    std::atomic<bool> malformed(false);
+    pool.run(nChunks, [&](int chunk, int) {	// parsing pass
+        vec3 * vertex = mesh.vertices.data() + firstVertex[chunk];
+        uint32_t * index = mesh.indices.data() + 3 * firstFace[chunk];
+        long long defined = (long long)firstVertex[chunk];	// vertices defined so far, negative indices count back from here
+        const char * end = bounds[chunk + 1];
+        for (const char * p = bounds[chunk]; p < end; skipLine(p, end)) {
+            skipBlanks(p, end);
+            if (end - p < 2 || (p[1] != ' ' && p[1] != '\t')) continue;
+            if (p[0] == 'v') {
+                p += 2;
+                if (!parseFloat(p, end, vertex->x) || !parseFloat(p, end, vertex->y) || !parseFloat(p, end, vertex->z)) { malformed = true; return; }
+                vertex++;
+                defined++;
+            } else if (p[0] == 'f') {
+                p += 2;
+                uint32_t first = 0, previous = 0;
+                for (int corner = 0;; corner++) {
+                    skipBlanks(p, end);
+                    if (p == end || *p == '\n' || *p == '#') break;
+                    long long i;
+                    if (!parseInt(p, end, i)) { malformed = true; return; }
+                    i = (i < 0) ? defined + i : i - 1;
+                    if (i < 0 || i >= (long long)mesh.vertices.size()) { malformed = true; return; }
+                    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;	// texture and normal indices
+                    if (corner == 0) first = (uint32_t)i;
+                    else if (corner >= 2) { *index++ = first; *index++ = previous; *index++ = (uint32_t)i; }
+                    previous = (uint32_t)i;
+                }
+            }
+        }
+    });
+    if (malformed) printf("Malformed vertex or face statement\n");
+    return !malformed;
+}
+
+// PLY header: the vertex element with float or double x, y, z and the face element with the list of
+// vertex indices. Elements after the faces are ignored.
+struct PLYHeader {
+    enum Format { ASCII, BINARY_LE, BINARY_BE } format = ASCII;
+    size_t nVertices = 0, nFaces = 0;
+    int vertexStride = 0, position[3] = { -1, -1, -1 };	// byte offsets in a binary vertex
+    int positionType[3] = { 0, 0, 0 };		// byte size of the coordinate: 4 float, 8 double
+    int vertexProperties = 0, positionProperty[3] = { -1, -1, -1 };	// property positions of ASCII vertices
+    int countSize = 0, indexSize = 0;		// byte size of the list count and the indices, 0 if not integers
+    int faceProperties = 0;
+    const char * body = nullptr;			// first byte after end_header
+};
+
+inline int plyTypeSize(const char * type, size_t length, bool& isFloat) {
+    static const char * const names[] = { "char", "uchar", "short", "ushort", "int", "uint", "float", "double",
+                                          "int8", "uint8", "int16", "uint16", "int32", "uint32", "float32", "float64" };
+    static const int sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 1, 1, 2, 2, 4, 4, 4, 8 };
+    for (int t = 0; t < 16; t++) {
+        if (strlen(names[t]) == length && !strncmp(type, names[t], length)) {
+            isFloat = (t % 8 >= 6);
+            return sizes[t];
+        }
+    }
+    return 0;
+}
+
+inline bool parsePLYHeader(const MappedFile& file, PLYHeader& header) {
+    const char * p = file.data(), * end = p + file.size();
+    if (file.size() < 4 || strncmp(p, "ply", 3)) return false;
+    enum { NONE, VERTEX, FACE, OTHER } element = NONE;
+    bool facesDone = false;
+    for (skipLine(p, end); p < end; skipLine(p, end)) {
+        const char * lineEnd = (const char *)memchr(p, '\n', end - p);
+        if (!lineEnd) return false;
+        std::string line(p, lineEnd);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        char word[3][64];
+        int nWords = sscanf(line.c_str(), "%63s %63s %63s", word[0], word[1], word[2]);
+        if (nWords <= 0) continue;
+        if (!strcmp(word[0], "end_header")) {
+            header.body = lineEnd + 1;
+            return header.position[0] >= 0 && header.position[1] >= 0 && header.position[2] >= 0;
+        }
+        if (!strcmp(word[0], "format") && nWords >= 2) {
+            if (!strcmp(word[1], "ascii")) header.format = PLYHeader::ASCII;
+            else if (!strcmp(word[1], "binary_little_endian")) header.format = PLYHeader::BINARY_LE;
+            else header.format = PLYHeader::BINARY_BE;
+        } else if (!strcmp(word[0], "element") && nWords >= 3) {
+            if (element == FACE) facesDone = true;
+            size_t count = (size_t)strtoull(word[2], nullptr, 10);
+            if (facesDone) element = OTHER;
+            else if (!strcmp(word[1], "vertex")) { element = VERTEX; header.nVertices = count; }
+            else if (!strcmp(word[1], "face")) { element = FACE; header.nFaces = count; }
+            else if (count > 0) { printf("PLY element %s before the faces is not supported\n", word[1]); return false; }
+        } else if (!strcmp(word[0], "property") && nWords >= 3) {
+            bool isFloat = false;
+            if (element == VERTEX) {
+                int size = plyTypeSize(word[1], strlen(word[1]), isFloat);
+                if (size == 0) { printf("PLY vertex property %s is not supported\n", line.c_str()); return false; }
+                for (int k = 0; k < 3; k++) {
+                    if (strcmp(word[2], k == 0 ? "x" : k == 1 ? "y" : "z")) continue;
+                    if (!isFloat) { printf("PLY vertex coordinates must be float or double\n"); return false; }
+                    header.position[k] = header.vertexStride;
+                    header.positionType[k] = size;
+                    header.positionProperty[k] = header.vertexProperties;
+                }
+                header.vertexStride += size;
+                header.vertexProperties++;
+            } else if (element == FACE) {
+                char words[5][64];
+                int n = sscanf(line.c_str(), "%63s %63s %63s %63s %63s", words[0], words[1], words[2], words[3], words[4]);
+                if (n != 5 || strcmp(words[1], "list") || (strcmp(words[4], "vertex_indices") && strcmp(words[4], "vertex_index")) ||
+                    header.faceProperties > 0) {
+                    printf("PLY faces must have the vertex index list only\n");
+                    return false;
+                }
+                header.countSize = plyTypeSize(words[2], strlen(words[2]), isFloat);
+                if (isFloat) header.countSize = 0;
+                header.indexSize = plyTypeSize(words[3], strlen(words[3]), isFloat);
+                if (isFloat) header.indexSize = 0;
+                header.faceProperties++;
+            }
+        }
+    }
+    return false;
+}
+
+template <class T> inline T readBinary(const char * p) {	// unaligned little endian load
+    T value;
+    memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+inline uint64_t readUnsigned(const char * p, int size) {
+    switch (size) {
+    case 1: return (uint8_t)*p;
+    case 2: return readBinary<uint16_t>(p);
+    case 4: return readBinary<uint32_t>(p);
+    default: return 0;
+    }
+}
+
+// corner 0 and 1 of a polygon are remembered, every further corner adds the triangle first, previous, index
+inline void addFanTriangle(Mesh& mesh, int corner, long long& first, long long& previous, long long index) {
+    if (corner == 0) first = index;
+    else if (corner == 2) {
+        mesh.indices.push_back((uint32_t)first);
+        mesh.indices.push_back((uint32_t)previous);
+        mesh.indices.push_back((uint32_t)index);
+    }
+    previous = index;
+}
+
+// Binary faces are parsed in parallel when all of them are triangles, which is checked by the size of the
+// face block and the counts themselves; other meshes are triangulated as fans by one thread.
+inline bool loadPLY(const MappedFile& file, Mesh& mesh, ThreadPool& pool) {
+    PLYHeader header;
+    if (!parsePLYHeader(file, header)) {
+        printf("Unsupported or malformed PLY header\n");
+        return false;
+    }
+    if (header.format == PLYHeader::BINARY_BE) {
+        printf("Big endian PLY files are not supported\n");
+        return false;
+    }
+    if (header.countSize == 0 || header.indexSize == 0 || header.nVertices >= (1u << 31)) {
+        printf("PLY face list must have integer counts and indices\n");
+        return false;
+    }
+    const char * end = file.data() + file.size();
+    // the counts of the header are bounded by the bytes after it before anything is allocated: a binary vertex
+    // takes vertexStride bytes and a face at least a triangle, an ASCII value at least a digit and a separator
+    bool ascii = header.format == PLYHeader::ASCII;
+    size_t bodyBytes = end - header.body + (ascii ? 1 : 0);	// the last ASCII value may end the file without a separator
+    size_t vertexSize = ascii ? 2 * (size_t)header.vertexProperties : (size_t)header.vertexStride;
+    size_t faceSize = ascii ? 2 * 4 : (size_t)(header.countSize + 3 * header.indexSize);
+    if (vertexSize == 0 || header.nVertices > bodyBytes / vertexSize || header.nFaces > (bodyBytes - header.nVertices * vertexSize) / faceSize) {
+        printf("PLY file is truncated\n");
+        return false;
+    }
+    mesh.vertices.resize(header.nVertices);
+    mesh.indices.clear();
+
+    if (ascii) {
+        const char * p = header.body;
+        for (size_t v = 0; v < header.nVertices; v++, skipLine(p, end)) {
+            for (int property = 0; property < header.vertexProperties; property++) {
+                float value;
+                if (!parseFloat(p, end, value)) { printf("Malformed PLY vertex %zu\n", v); return false; }
+                for (int k = 0; k < 3; k++) if (property == header.positionProperty[k]) (&mesh.vertices[v].x)[k] = value;
+            }
+        }
+        mesh.indices.reserve(header.nFaces * 3);
+        for (size_t f = 0; f < header.nFaces; f++, skipLine(p, end)) {
+            long long count, index, first = 0, previous = 0;
+            if (!parseInt(p, end, count)) { printf("Malformed PLY face %zu\n", f); return false; }
+            for (long long corner = 0; corner < count; corner++) {
+                if (!parseInt(p, end, index) || index < 0 || index >= (long long)header.nVertices) { printf("Malformed PLY face %zu\n", f); return false; }
+                addFanTriangle(mesh, (int)std::min(corner, 2LL), first, previous, index);
+            }
+        }
+        return true;
+    }
+
+    size_t vertexBytes = header.nVertices * header.vertexStride;
+    if ((size_t)(end - header.body) < vertexBytes) { printf("PLY file is truncated\n"); return false; }
+    const int nTasks = pool.size() * 4;
+    pool.run(nTasks, [&](int task, int) {
+        size_t v0 = header.nVertices * task / nTasks, v1 = header.nVertices * (task + 1) / nTasks;
+        for (size_t v = v0; v < v1; v++) {
+            const char * vertex = header.body + v * header.vertexStride;
+            for (int k = 0; k < 3; k++) {
+                const char * q = vertex + header.position[k];
+                (&mesh.vertices[v].x)[k] = (header.positionType[k] == 8) ? (float)readBinary<double>(q) : readBinary<float>(q);
+            }
+        }
+    });
+
+    const char * faces = header.body + vertexBytes;
+    size_t triangleStride = header.countSize + 3 * header.indexSize;
+    std::atomic<bool> valid(end - faces >= (ptrdiff_t)(header.nFaces * triangleStride));
+    if (valid) {	// assume triangles, fall back to the sequential parser if a face is not one
+        mesh.indices.resize(header.nFaces * 3);
+        pool.run(nTasks, [&](int task, int) {
+            size_t f0 = header.nFaces * task / nTasks, f1 = header.nFaces * (task + 1) / nTasks;
+            for (size_t f = f0; f < f1 && valid; f++) {
+                const char * face = faces + f * triangleStride;
+                if (readUnsigned(face, header.countSize) != 3) { valid = false; return; }
+                for (int k = 0; k < 3; k++) {
+                    uint64_t index = readUnsigned(face + header.countSize + k * header.indexSize, header.indexSize);
+                    if (index >= header.nVertices) { valid = false; return; }
+                    mesh.indices[3 * f + k] = (uint32_t)index;
+                }
+            }
+        });
+        if (valid) return true;
+    }
+    mesh.indices.clear();
+    const char * p = faces;
+    for (size_t f = 0; f < header.nFaces; f++) {
+        if (end - p < header.countSize) { printf("PLY file is truncated\n"); return false; }
+        uint64_t count = readUnsigned(p, header.countSize);
+        p += header.countSize;
+        if ((uint64_t)(end - p) < count * header.indexSize) { printf("PLY file is truncated\n"); return false; }
+        long long first = 0, previous = 0;
+        for (uint64_t corner = 0; corner < count; corner++, p += header.indexSize) {
+            uint64_t index = readUnsigned(p, header.indexSize);
+            if (index >= header.nVertices) { printf("PLY face %zu has a bad index\n", f); return false; }
+            addFanTriangle(mesh, (int)std::min(corner, (uint64_t)2), first, previous, (long long)index);
+        }
+    }
+    return true;
+}
+
+// loads an .obj or .ply file into mesh, false with a message if it cannot be read
+inline bool loadMesh(const std::string& pathname, Mesh& mesh, ThreadPool& pool) {
+    MappedFile file;
+    if (!file.open(pathname)) {
+        printf("%s cannot be read\n", pathname.c_str());
+        return false;
+    }
+    size_t dot = pathname.find_last_of('.');
+    std::string extension = (dot == std::string::npos) ? "" : pathname.substr(dot + 1);
+    for (char& c : extension) c = (char)tolower(c);
+    bool loaded;
+    if (extension == "obj") loaded = loadOBJ(file, mesh, pool);
+    else if (extension == "ply") loaded = loadPLY(file, mesh, pool);
+    else {
+        printf("%s is not an .obj or .ply file\n", pathname.c_str());
+        return false;
+    }
+    if (!loaded) printf("%s cannot be loaded\n", pathname.c_str());
+    else if (mesh.faceCount() >= (1u << 28)) {	// PrimitiveRef has 28 bits of index
+        printf("%s has too many faces\n", pathname.c_str());
+        return false;
+    }
+    return loaded;
+}
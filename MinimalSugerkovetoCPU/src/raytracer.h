@@ -0,0 +1,3188 @@
+//=============================================================================================
+// CPU ray tracer: scene, acceleration structures and tiled multithreaded rendering.
+// Shared by the GLUT program (Skeleton.cpp) and the headless renderer (headless.cpp).
+//=============================================================================================
+#pragma once
+#include "framework.h"
+#include <float.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <type_traits>
+#include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#include "sampler.h"
+
+struct Material {
+    vec3 ka, kd, ks;
+    float  shininess;
+    vec3 F0;				// Fresnel reflectance at perpendicular incidence of smooth materials
+    float ior = 1;			// index of refraction of refractive materials
+    bool rough = true, reflective = false, refractive = false;
+    Material(vec3 _kd, vec3 _ks, float _shininess) : ka(_kd * M_PI), kd(_kd), ks(_ks) { shininess = _shininess; }
+protected:
+    Material() { rough = false; shininess = 0; }
+};
+
+// ideal mirror of complex index of refraction n + i kappa, e.g. metals
+struct ReflectiveMaterial : Material {
+    ReflectiveMaterial(vec3 n, vec3 kappa) {
+        vec3 one(1, 1, 1), num = (n - one) * (n - one) + kappa * kappa, denom = (n + one) * (n + one) + kappa * kappa;
+        F0 = vec3(num.x / denom.x, num.y / denom.y, num.z / denom.z);
+        reflective = true;
+    }
+};
+
+// ideal dielectric, it both reflects and refracts
+struct RefractiveMaterial : Material {
+    RefractiveMaterial(float n) {
+        float f = (n - 1) / (n + 1);
+        F0 = vec3(f * f, f * f, f * f);
+        ior = n;
+        reflective = refractive = true;
+    }
+};
+
+// Reference to a primitive: its kind (position in the kind list) and its index in the array of that kind.
+struct PrimitiveRef {
+    unsigned int kind : 4;
+    unsigned int index : 28;
+    PrimitiveRef(int _kind = 15, int _index = 0) : kind(_kind), index(_index) { }
+    bool valid() const { return kind != 15; }
+};
+
+// Intersection tests only find t and the primitive, the surface attributes are filled once for the closest hit.
+struct Hit {
+    float t;
+    PrimitiveRef primitive;
+    vec3 position, normal;
+    Material * material;
+    bool front;		// the ray arrived from the outside, the normal is flipped to face the ray otherwise
+    Hit() { t = -1; }
+};
+
+struct Ray {
+    vec3 start, dir;
+    Ray() { }
+    Ray(vec3 _start, vec3 _dir) {
+        start = _start;
+        dir = normalize(_dir);
+    }
+};
+
+inline float axis(const vec3& v, int a) { return *(&v.x + a); }
+inline float& axis(vec3& v, int a) { return *(&v.x + a); }
+
+// Work counters and stage times of the render. Every thread counts into its own copy (threadStats), the
+// copies are merged by the scene after each tile, so the hot loops never touch shared memory.
+struct RenderStats {
+    uint64_t primaryRays = 0, shadowRays = 0, secondaryRays = 0;
+    uint64_t intersectionTests = 0;	// ray-primitive tests, a SIMD lane counts as one test
+    uint64_t nodesVisited = 0;		// BVH nodes, a packet entering a node counts once
+    uint64_t generationTime = 0, traversalTime = 0, shadingTime = 0, uploadTime = 0;	// nanoseconds summed over the threads
+
+    RenderStats& operator+=(const RenderStats& s) {
+        primaryRays += s.primaryRays;
+        shadowRays += s.shadowRays;
+        secondaryRays += s.secondaryRays;
+        intersectionTests += s.intersectionTests;
+        nodesVisited += s.nodesVisited;
+        generationTime += s.generationTime;
+        traversalTime += s.traversalTime;
+        shadingTime += s.shadingTime;
+        uploadTime += s.uploadTime;
+        return *this;
+    }
+    uint64_t rays() const { return primaryRays + shadowRays + secondaryRays; }
+    uint64_t work() const { return intersectionTests + nodesVisited; }	// cost measure of the heatmap
+
+    void print() const {
+        double perRay = rays() ? 1.0 / rays() : 0;
+        printf("Rays: %llu primary, %llu shadow, %llu secondary\n", (unsigned long long)primaryRays,
+               (unsigned long long)shadowRays, (unsigned long long)secondaryRays);
+        printf("Intersection tests: %llu (%.2f per ray), BVH nodes visited: %llu (%.2f per ray)\n",
+               (unsigned long long)intersectionTests, intersectionTests * perRay, (unsigned long long)nodesVisited, nodesVisited * perRay);
+        printf("Stage times (thread milliseconds): generation %.1f, traversal %.1f, shading %.1f, upload %.1f\n",
+               generationTime * 1e-6, traversalTime * 1e-6, shadingTime * 1e-6, uploadTime * 1e-6);
+    }
+};
+
+// Measures consecutive stages: lap adds the time since the previous lap to a counter. Disabled timers
+// do not read the clock.
+class StageTimer {
+    bool enabled;
+    std::chrono::steady_clock::time_point last;
+public:
+    StageTimer(bool _enabled) : enabled(_enabled) { if (enabled) last = std::chrono::steady_clock::now(); }
+    void lap(uint64_t& time) {
+        if (!enabled) return;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        time += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+        last = now;
+    }
+};
+
+inline RenderStats& threadStats() {
+    static thread_local RenderStats stats;
+    return stats;
+}
+
+struct AABB {
+    vec3 bmin, bmax;
+    AABB() : bmin(FLT_MAX, FLT_MAX, FLT_MAX), bmax(-FLT_MAX, -FLT_MAX, -FLT_MAX) { }
+    AABB(const vec3& _bmin, const vec3& _bmax) : bmin(_bmin), bmax(_bmax) { }
+
+    // std::min / max compile to single instructions, fminf / fmaxf are libm calls without -ffast-math
+    // (and pay an AVX to SSE transition in AVX2 builds); the build only grows boxes by finite values
+    void grow(const vec3& p) {
+        bmin = vec3(std::min(bmin.x, p.x), std::min(bmin.y, p.y), std::min(bmin.z, p.z));
+        bmax = vec3(std::max(bmax.x, p.x), std::max(bmax.y, p.y), std::max(bmax.z, p.z));
+    }
+    void grow(const AABB& b) {
+        bmin = vec3(std::min(bmin.x, b.bmin.x), std::min(bmin.y, b.bmin.y), std::min(bmin.z, b.bmin.z));
+        bmax = vec3(std::max(bmax.x, b.bmax.x), std::max(bmax.y, b.bmax.y), std::max(bmax.z, b.bmax.z));
+    }
+    vec3 center() const { return (bmin + bmax) * 0.5f; }
+    float area() const {
+        if (bmax.x < bmin.x) return 0;	// empty box
+        vec3 d = bmax - bmin;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // slab test, returns the entry distance or FLT_MAX if the box is missed or farther than tMax
+    // std::max(t, x) and std::min(t, x) keep t when x is NaN (0 * inf of a ray lying in a slab plane it is
+    // parallel to), so that slab does not cut the interval; unlike fmaxf / fminf they are single instructions
+    float intersect(const Ray& ray, const vec3& invDir, float tMax) const {
+        float tNear = -FLT_MAX, tFar = FLT_MAX;
+        float tx1 = (bmin.x - ray.start.x) * invDir.x, tx2 = (bmax.x - ray.start.x) * invDir.x;
+        tNear = std::max(tNear, std::min(tx1, tx2)); tFar = std::min(tFar, std::max(tx1, tx2));
+        float ty1 = (bmin.y - ray.start.y) * invDir.y, ty2 = (bmax.y - ray.start.y) * invDir.y;
+        tNear = std::max(tNear, std::min(ty1, ty2)); tFar = std::min(tFar, std::max(ty1, ty2));
+        float tz1 = (bmin.z - ray.start.z) * invDir.z, tz2 = (bmax.z - ray.start.z) * invDir.z;
+        tNear = std::max(tNear, std::min(tz1, tz2)); tFar = std::min(tFar, std::max(tz1, tz2));
+        return (tFar >= tNear && tFar > 0 && tNear < tMax) ? tNear : FLT_MAX;
+    }
+};
+
+// Primary rays of a screen tile, all starting at the eye. The four planes through the eye and the tile
+// corners enclose every ray of the packet, so a box outside one of them is missed by the whole packet.
+struct RayPacket {
+    static const int tileSize = 8;
+    static const int maxSize = tileSize * tileSize;
+    Ray rays[maxSize];
+    vec3 invDirs[maxSize];
+    Hit hits[maxSize];
+    int X[maxSize], Y[maxSize];
+    int count = 0;
+    vec3 origin;
+    vec3 planes[4];	// inward normals of the frustum planes
+
+    float tMax(int i) const { return (hits[i].t > 0) ? hits[i].t : FLT_MAX; }
+
+    bool frustumMisses(const AABB& box) const {
+        for (int p = 0; p < 4; p++) {
+            const vec3& n = planes[p];
+            vec3 v(n.x > 0 ? box.bmax.x : box.bmin.x, n.y > 0 ? box.bmax.y : box.bmin.y, n.z > 0 ? box.bmax.z : box.bmin.z);
+            if (dot(n, v - origin) < 0) return true;
+        }
+        return false;
+    }
+
+    // index of the first ray from first on that hits the box closer than its current hit, count if none
+    int firstActive(const AABB& box, int first) const {
+        if (box.intersect(rays[first], invDirs[first], tMax(first)) != FLT_MAX) return first;
+        if (frustumMisses(box)) return count;
+        for (first++; first < count; first++)
+            if (box.intersect(rays[first], invDirs[first], tMax(first)) != FLT_MAX) return first;
+        return count;
+    }
+};
+
+// Primitives are plain structs stored by value, without a common base class. Each kind provides
+//   float intersect(const Ray& ray, float tMax) const;	// smallest t > 0, negative if missed (may be if beyond tMax)
+//   void surface(const Ray& ray, Hit& hit) const;	// position, normal and material at hit.t
+//   bool occluded(const Ray& ray) const;			// any intersection with t > 0
+//   AABB bounds() const;
+// and is added to the kind list of the Primitives typedef below.
+struct Sphere {
+    vec3 center;
+    float radius;
+    Material * material;
+
+    Sphere(const vec3& _center, float _radius, Material* _material) {
+        center = _center;
+        radius = _radius;
+        material = _material;
+    }
+
+    // half b form, with the operations of the SphereSoA kernel in the same order so both find the same t;
+    // a is not 1 for the unnormalized rays of instances
+    float intersect(const Ray& ray, float = FLT_MAX) const {
+        vec3 dist = ray.start - center;
+        float a = dot(ray.dir, ray.dir);
+        float b = dot(dist, ray.dir);
+        float c = dot(dist, dist) - radius * radius;
+        float discr = b * b - a * c;
+        if (discr < 0) return -1;
+        float sqrt_discr = sqrtf(discr);
+        float t1 = (sqrt_discr - b) / a;	// t1 >= t2 for sure
+        float t2 = (-b - sqrt_discr) / a;
+        if (t1 <= 0) return -1;
+        return (t2 > 0) ? t2 : t1;
+    }
+
+    void surface(const Ray& ray, Hit& hit) const {
+        hit.position = ray.start + ray.dir * hit.t;
+        hit.normal = (hit.position - center) * (1.0f / radius);
+        hit.material = material;
+    }
+
+    // the larger root -b + sqrt(b^2 - c) is positive if the start is inside (c < 0) or the center is ahead (b < 0)
+    bool occluded(const Ray& ray) const {
+        vec3 dist = ray.start - center;
+        float b = dot(dist, ray.dir);
+        float c = dot(dist, dist) - radius * radius;
+        return c < 0 || (b < 0 && b * b - dot(ray.dir, ray.dir) * c >= 0);
+    }
+
+    AABB bounds() const { return AABB(center - vec3(radius, radius, radius), center + vec3(radius, radius, radius)); }
+};
+
+// Indexed triangle mesh, three indices per face. Owned by the scene once added, its triangles point into it.
+// The arrays are either owned or views of a mapped scene file, which are read only.
+struct Mesh {
+    std::vector<vec3> vertices;
+    std::vector<uint32_t> indices;
+    const vec3 * vertexView = nullptr;	// used instead of vertices and indices if set
+    const uint32_t * indexView = nullptr;
+    size_t vertexViewSize = 0, indexViewSize = 0;
+    Material * material = nullptr;	// the rough material of Scene::build if not set
+
+    void view(const vec3 * _vertices, size_t nVertices, const uint32_t * _indices, size_t nIndices) {
+        vertexView = _vertices; vertexViewSize = nVertices;
+        indexView = _indices; indexViewSize = nIndices;
+    }
+
+    const vec3 * vertexData() const { return vertexView ? vertexView : vertices.data(); }
+    const uint32_t * indexData() const { return vertexView ? indexView : indices.data(); }
+    size_t vertexCount() const { return vertexView ? vertexViewSize : vertices.size(); }
+    size_t faceCount() const { return (vertexView ? indexViewSize : indices.size()) / 3; }
+
+    AABB bounds() const {
+        AABB box;
+        for (size_t i = 0; i < vertexCount(); i++) box.grow(vertexData()[i]);
+        return box;
+    }
+
+    void fit(const vec3& center, float size) {	// scales and moves the owned vertices into the cube of the given center and size
+        AABB box = bounds();
+        vec3 extent = box.bmax - box.bmin;
+        float maxExtent = fmaxf(extent.x, fmaxf(extent.y, extent.z));
+        if (maxExtent <= 0) return;
+        float scale = size / maxExtent;
+        vec3 offset = center - box.center() * scale;
+        for (vec3& v : vertices) v = v * scale + offset;
+    }
+};
+
+struct Triangle {
+    const Mesh * mesh;
+    uint32_t face;
+
+    Triangle(const Mesh * _mesh, uint32_t _face) : mesh(_mesh), face(_face) { }
+
+    const vec3& vertex(int k) const { return mesh->vertexData()[mesh->indexData()[3 * face + k]]; }
+
+    // Watertight test (Woop, Benthin, Wald 2013): the vertices are sheared into the space of the ray, where
+    // the edge functions are exact 2D cross products. Rays through a shared edge or vertex hit at least
+    // one of the adjacent triangles, so closed meshes have no cracks.
+    float intersect(const Ray& ray, float = FLT_MAX) const {
+        int kz = (fabsf(ray.dir.x) > fabsf(ray.dir.y)) ? ((fabsf(ray.dir.x) > fabsf(ray.dir.z)) ? 0 : 2) : ((fabsf(ray.dir.y) > fabsf(ray.dir.z)) ? 1 : 2);
+        int kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+        float dz = axis(ray.dir, kz);
+        if (dz < 0) std::swap(kx, ky);	// keeps the winding
+        float Sx = axis(ray.dir, kx) / dz, Sy = axis(ray.dir, ky) / dz, Sz = 1.0f / dz;
+        vec3 A = vertex(0) - ray.start, B = vertex(1) - ray.start, C = vertex(2) - ray.start;
+        float Ax = axis(A, kx) - Sx * axis(A, kz), Ay = axis(A, ky) - Sy * axis(A, kz);
+        float Bx = axis(B, kx) - Sx * axis(B, kz), By = axis(B, ky) - Sy * axis(B, kz);
+        float Cx = axis(C, kx) - Sx * axis(C, kz), Cy = axis(C, ky) - Sy * axis(C, kz);
+        // The edge functions are evaluated in double, where the products of floats are exact and the sign of
+        // the difference is right. In float, the fused multiply-adds of FMA builds make the two triangles of an
+        // edge disagree about rays through the edge, which leaves cracks.
+        float U = (float)((double)Cx * By - (double)Cy * Bx);
+        float V = (float)((double)Ax * Cy - (double)Ay * Cx);
+        float W = (float)((double)Bx * Ay - (double)By * Ax);
+        if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return -1;
+        float det = U + V + W;
+        if (det == 0) return -1;
+        float T = U * Sz * axis(A, kz) + V * Sz * axis(B, kz) + W * Sz * axis(C, kz);
+        float t = T / det;
+        return (t > 0) ? t : -1;
+    }
+
+    void surface(const Ray& ray, Hit& hit) const {	// flat shaded, the mesh has no vertex normals
+        hit.position = ray.start + ray.dir * hit.t;
+        hit.normal = normalize(cross(vertex(1) - vertex(0), vertex(2) - vertex(0)));
+        hit.material = mesh->material;
+    }
+
+    bool occluded(const Ray& ray) const { return intersect(ray) > 0; }
+
+    AABB bounds() const {
+        AABB box;
+        for (int k = 0; k < 3; k++) box.grow(vertex(k));
+        return box;
+    }
+};
+
+// points and directions are row vectors multiplied from the left, as in the framework
+inline vec3 transformPoint(const vec3& p, const mat4& m) {
+    vec4 r = vec4(p.x, p.y, p.z, 1) * m;
+    return vec3(r.x, r.y, r.z);
+}
+inline vec3 transformVector(const vec3& v, const mat4& m) {
+    vec4 r = vec4(v.x, v.y, v.z, 0) * m;
+    return vec3(r.x, r.y, r.z);
+}
+
+inline mat4 invertAffine(const mat4& m) {	// the last column of m is (0, 0, 0, 1)
+    vec3 a(m[0].x, m[0].y, m[0].z), b(m[1].x, m[1].y, m[1].z), c(m[2].x, m[2].y, m[2].z);
+    vec3 ra = cross(b, c), rb = cross(c, a), rc = cross(a, b);	// columns of the adjugate
+    float invDet = 1.0f / dot(a, ra);
+    mat4 inverse(ra.x * invDet, rb.x * invDet, rc.x * invDet, 0,
+                 ra.y * invDet, rb.y * invDet, rc.y * invDet, 0,
+                 ra.z * invDet, rb.z * invDet, rc.z * invDet, 0,
+                 0, 0, 0, 1);
+    vec3 t = transformVector(vec3(m[3].x, m[3].y, m[3].z), inverse);
+    inverse[3] = vec4(-t.x, -t.y, -t.z, 1);
+    return inverse;
+}
+
+struct Model;
+
+// Copy of a shared Model placed by an affine transform. The instance only stores the transforms, the
+// ray is moved into model space and traced against the bottom-level BVH of the model. The direction
+// is not normalized there, so the ray parameter t is the same in both spaces.
+struct Instance {
+    const Model * model;
+    mat4 toWorld, toModel;
+    Material * material;	// replaces the materials of the model if not null
+
+    Instance(const Model * _model, const mat4& transform, Material * _material = nullptr) : model(_model), material(_material) {
+        setTransform(transform);
+    }
+
+    void setTransform(const mat4& transform) {
+        toWorld = transform;
+        toModel = invertAffine(transform);
+    }
+
+    // In double: surface must find the hit of intersect again, and the copies inlined into both round
+    // to the same floats whether or not the compiler contracted them to FMA instructions.
+    Ray modelRay(const Ray& ray) const {
+        Ray local;
+        local.start = transform(ray.start, 1);
+        local.dir = transform(ray.dir, 0);
+        return local;
+    }
+    vec3 transform(const vec3& v, double w) const {
+        double x = v.x, y = v.y, z = v.z;
+        return vec3((float)(x * toModel[0].x + y * toModel[1].x + z * toModel[2].x + w * toModel[3].x),
+                    (float)(x * toModel[0].y + y * toModel[1].y + z * toModel[2].y + w * toModel[3].y),
+                    (float)(x * toModel[0].z + y * toModel[1].z + z * toModel[2].z + w * toModel[3].z));
+    }
+
+    float intersect(const Ray& ray, float tMax = FLT_MAX) const;
+    void surface(const Ray& ray, Hit& hit) const;
+    bool occluded(const Ray& ray) const;
+    AABB bounds() const;
+};
+
+// One contiguous array per primitive kind. visit and forEach call a generic lambda with the primitive
+// as its concrete type, so the compiler resolves every call statically and can inline it.
+template <int K, class... Kinds> class PrimitiveArrays {
+protected:
+    void add();
+    void at();
+public:
+    template <class F> void visit(PrimitiveRef, F&&) const { }
+    template <class F> bool anyOf(F&&, int = 0) const { return false; }
+    void clear() { }
+    size_t size(int = 0) const { return 0; }
+};
+
+template <int K, class Kind, class... Rest> class PrimitiveArrays<K, Kind, Rest...> : public PrimitiveArrays<K + 1, Rest...> {
+    typedef PrimitiveArrays<K + 1, Rest...> Base;
+    std::vector<Kind> items;
+public:
+    using Base::add;
+    PrimitiveRef add(const Kind& primitive) {
+        items.push_back(primitive);
+        return PrimitiveRef(K, (int)items.size() - 1);
+    }
+
+    PrimitiveRef add(const Kind& primitive, size_t copies) {	// copies to be replaced through get, e.g. in parallel
+        items.resize(items.size() + copies, primitive);
+        return PrimitiveRef(K, (int)(items.size() - copies));
+    }
+
+    using Base::at;
+    Kind& at(PrimitiveRef ref, const Kind *) { return items[ref.index]; }
+    template <class T> T& get(PrimitiveRef ref) { return at(ref, (const T *)nullptr); }	// ref must be of kind T
+
+    template <class F> void visit(PrimitiveRef ref, F&& f) const {
+        if (ref.kind == K) f(items[ref.index]);
+        else Base::visit(ref, f);
+    }
+    // f(primitive, ref) for every primitive until f returns true, kinds before firstKind are skipped
+    template <class F> bool anyOf(F&& f, int firstKind = 0) const {
+        if (K >= firstKind)
+            for (size_t i = 0; i < items.size(); i++) if (f(items[i], PrimitiveRef(K, (int)i))) return true;
+        return Base::anyOf(f, firstKind);
+    }
+    template <class F> void forEach(F&& f, int firstKind = 0) const {
+        anyOf([&](const auto& primitive, PrimitiveRef ref) { f(primitive, ref); return false; }, firstKind);
+    }
+    void clear() { items.clear(); Base::clear(); }
+    size_t size(int firstKind = 0) const { return (K >= firstKind ? items.size() : 0) + Base::size(firstKind); }
+};
+
+template <class... Kinds> using PrimitiveStore = PrimitiveArrays<0, Kinds...>;
+typedef PrimitiveStore<Sphere, Triangle, Instance> Primitives;	// SIMD_SCAN keeps the spheres (kind 0) in a SphereSoA as well
+
+class Camera {
+    vec3 eye, lookat, vup, right, up;
+    float fov;
+    int width = windowWidth, height = windowHeight;	// resolution of the image in pixels
+public:
+    void setResolution(int _width, int _height) { width = _width; height = _height; }
+    void set(vec3 _eye, vec3 _lookat, vec3 _vup, float _fov) {
+        eye = _eye;
+        lookat = _lookat;
+        vup = _vup;
+        fov = _fov;
+        vec3 w = eye - lookat;
+        float focus = length(w);
+        right = normalize(cross(vup, w)) * focus * tanf(fov / 2);
+        up = normalize(cross(w, right)) * focus * tanf(fov / 2);
+    }
+    void get(vec3& _eye, vec3& _lookat, vec3& _vup, float& _fov) const {
+        _eye = eye; _lookat = lookat; _vup = vup; _fov = fov;
+    }
+    void orbit(float angle) {	// turns the eye around the vertical axis through lookat, like Animate of the GPU sample
+        vec3 d = eye - lookat;
+        set(lookat + vec3(d.x * cosf(angle) + d.z * sinf(angle), d.y, -d.x * sinf(angle) + d.z * cosf(angle)), lookat, vup, fov);
+    }
+    Ray getRay(int X, int Y, float dx = 0.5f, float dy = 0.5f) {	// (dx, dy): position inside the pixel
+        vec3 dir = lookat + right * (2.0f * (X + dx) / width - 1) + up * (2.0f * (Y + dy) / height - 1) - eye;
+        return Ray(eye, dir);
+    }
+    // Pixels [X0, X1] x [Y0, Y1] whose rays may hit the sphere, false if no ray of the image can. The
+    // bounds come from the planes through the eye tangent to the sphere, padded by half a pixel against
+    // rounding; a sphere reaching behind the eye plane covers the whole image.
+    bool pixelBounds(const vec3& center, float radius, int& X0, int& Y0, int& X1, int& Y1) const {
+        vec3 d = center - eye, forward = lookat - eye;
+        float focus = length(forward), z = dot(d, forward) / focus;
+        if (z < -radius) return false;
+        X0 = 0; Y0 = 0; X1 = width - 1; Y1 = height - 1;
+        float denominator = z * z - radius * radius;
+        if (z <= radius || denominator <= 1e-6f * z * z) return true;
+        auto range = [&](const vec3& axis, int resolution, int& lo, int& hi) {	// tangents x = k z in the plane of axis and forward
+            float axisLength = length(axis), x = dot(d, axis) / axisLength, root = radius * sqrtf(x * x + denominator);
+            float scale = focus / axisLength * 0.5f * resolution;	// pixels per unit of k
+            float k0 = (x * z - root) / denominator, k1 = (x * z + root) / denominator;
+            float p0 = floorf((k0 * scale + 0.5f * resolution) - 0.5f), p1 = floorf((k1 * scale + 0.5f * resolution) + 0.5f);
+            if (p1 < 0 || p0 >= resolution) return false;
+            lo = (int)std::max(p0, 0.0f);
+            hi = (int)std::min(p1, resolution - 1.0f);
+            return true;
+        };
+        return range(right, width, X0, X1) && range(up, height, Y0, Y1);
+    }
+    void getPacket(int X0, int Y0, RayPacket& packet) {	// rays of the tile whose lower left pixel is (X0, Y0)
+        int X1 = std::min(X0 + RayPacket::tileSize, width), Y1 = std::min(Y0 + RayPacket::tileSize, height);
+        packet.count = 0;
+        packet.origin = eye;
+        for (int Y = Y0; Y < Y1; Y++) {
+            for (int X = X0; X < X1; X++) {
+                int i = packet.count++;
+                packet.rays[i] = getRay(X, Y);
+                packet.invDirs[i] = vec3(1.0f / packet.rays[i].dir.x, 1.0f / packet.rays[i].dir.y, 1.0f / packet.rays[i].dir.z);
+                packet.hits[i] = Hit();
+                packet.X[i] = X; packet.Y[i] = Y;
+            }
+        }
+        vec3 corners[4];	// directions through the pixel edges at the tile corners
+        int cornerX[4] = { X0, X1, X1, X0 }, cornerY[4] = { Y0, Y0, Y1, Y1 };
+        for (int c = 0; c < 4; c++)
+            corners[c] = lookat + right * (2.0f * cornerX[c] / width - 1) + up * (2.0f * cornerY[c] / height - 1) - eye;
+        vec3 center = corners[0] + corners[1] + corners[2] + corners[3];
+        for (int p = 0; p < 4; p++) {
+            vec3 n = cross(corners[p], corners[(p + 1) % 4]);
+            packet.planes[p] = (dot(n, center) < 0) ? -n : n;
+        }
+    }
+};
+
+struct Light {
+    vec3 direction;
+    vec3 Le;
+    Light(vec3 _direction, vec3 _Le) {
+        direction = normalize(_direction);
+        Le = _Le;
+    }
+};
+
+// Spheres packed as structure of arrays for the SIMD kernel. The arrays are padded to a multiple of
+// simdWidth with empty spheres (radius^2 = -1) that can never be hit by a ray with unit direction.
+class SphereSoA {
+    std::vector<float> cx, cy, cz, r2;
+    std::vector<PrimitiveRef> refs;		// the sphere in the Primitives store
+    int count = 0;
+
+    void pad() {
+        while (cx.size() % simdWidth != 0) {
+            cx.push_back(0); cy.push_back(0); cz.push_back(0);
+            r2.push_back(-1); refs.push_back(PrimitiveRef());
+        }
+    }
+public:
+#if defined(__AVX2__)
+    static const int simdWidth = 8;
+#else
+    static const int simdWidth = 4;
+#endif
+
+    void clear() {
+        cx.clear(); cy.clear(); cz.clear(); r2.clear(); refs.clear();
+        count = 0;
+    }
+
+    void add(const vec3& center, float radius, PrimitiveRef ref) {
+        cx.resize(count); cy.resize(count); cz.resize(count);	// drop the padding
+        r2.resize(count); refs.resize(count);
+        cx.push_back(center.x); cy.push_back(center.y); cz.push_back(center.z);
+        r2.push_back(radius * radius); refs.push_back(ref);
+        count++;
+        pad();
+    }
+
+    int size() const { return count; }
+    PrimitiveRef ref(int i) const { return refs[i]; }
+
+    void move(int i, const vec3& center) {
+        cx[i] = center.x; cy[i] = center.y; cz[i] = center.z;
+    }
+
+    void append(int n) {	// n spheres to be filled by set, e.g. in parallel
+        count += n;
+        cx.resize(count); cy.resize(count); cz.resize(count);
+        r2.resize(count); refs.resize(count);
+        pad();
+    }
+    void set(int i, const vec3& center, float radius, PrimitiveRef ref) {
+        move(i, center);
+        r2[i] = radius * radius;
+        refs[i] = ref;
+    }
+
+    bool occluded(const Ray& ray, int i) const {	// same test as Sphere::occluded
+        float ocx = ray.start.x - cx[i], ocy = ray.start.y - cy[i], ocz = ray.start.z - cz[i];
+        float b = ocx * ray.dir.x + ocy * ray.dir.y + ocz * ray.dir.z;
+        float c = ocx * ocx + ocy * ocy + ocz * ocz - r2[i];
+        return c < 0 || (b < 0 && b * b - dot(ray.dir, ray.dir) * c >= 0);
+    }
+
+    // index of any sphere intersected at t > 0, -1 if none; stops at the first block containing a hit
+    int anyIntersect(const Ray& ray) const {
+        int n = (int)cx.size();
+#if defined(__AVX2__)
+        __m256 ox = _mm256_set1_ps(ray.start.x), oy = _mm256_set1_ps(ray.start.y), oz = _mm256_set1_ps(ray.start.z);
+        __m256 dx = _mm256_set1_ps(ray.dir.x), dy = _mm256_set1_ps(ray.dir.y), dz = _mm256_set1_ps(ray.dir.z);
+        __m256 zero = _mm256_setzero_ps(), a = _mm256_set1_ps(dot(ray.dir, ray.dir));
+        for (int i = 0; i < n; i += 8) {
+            __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&cx[i]));
+            __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&cy[i]));
+            __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&cz[i]));
+            __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+            __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(&r2[i]));
+            __m256 hit = _mm256_or_ps(_mm256_cmp_ps(c, zero, _CMP_LT_OQ),
+                         _mm256_and_ps(_mm256_cmp_ps(b, zero, _CMP_LT_OQ), _mm256_cmp_ps(_mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, c)), zero, _CMP_GE_OQ)));
+            int mask = _mm256_movemask_ps(hit);
+            if (mask) {
+                threadStats().intersectionTests += i + 8;
+                for (int l = 0; l < 8; l++) if (mask & (1 << l)) return i + l;
+            }
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        __m128 ox = _mm_set1_ps(ray.start.x), oy = _mm_set1_ps(ray.start.y), oz = _mm_set1_ps(ray.start.z);
+        __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+        __m128 zero = _mm_setzero_ps(), a = _mm_set1_ps(dot(ray.dir, ray.dir));
+        for (int i = 0; i < n; i += 4) {
+            __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&cx[i]));
+            __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&cy[i]));
+            __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&cz[i]));
+            __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+            __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_loadu_ps(&r2[i]));
+            __m128 hit = _mm_or_ps(_mm_cmplt_ps(c, zero),
+                         _mm_and_ps(_mm_cmplt_ps(b, zero), _mm_cmpge_ps(_mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c)), zero)));
+            int mask = _mm_movemask_ps(hit);
+            if (mask) {
+                threadStats().intersectionTests += i + 4;
+                for (int l = 0; l < 4; l++) if (mask & (1 << l)) return i + l;
+            }
+        }
+#else
+        for (int i = 0; i < n; i++) if (occluded(ray, i)) { threadStats().intersectionTests += i + 1; return i; }
+#endif
+        threadStats().intersectionTests += n;
+        return -1;
+    }
+
+    // nearest positive ray parameter over all spheres, returns the sphere index or -1. The lanes take the
+    // operations of Sphere::intersect in the same order and without FMA, so every accelerator finds the same t.
+    int firstIntersect(const Ray& ray, float& tBest) const {
+        tBest = FLT_MAX;
+        int best = -1;
+        int n = (int)cx.size();
+        threadStats().intersectionTests += n;
+#if defined(__AVX2__)
+        __m256 ox = _mm256_set1_ps(ray.start.x), oy = _mm256_set1_ps(ray.start.y), oz = _mm256_set1_ps(ray.start.z);
+        __m256 dx = _mm256_set1_ps(ray.dir.x), dy = _mm256_set1_ps(ray.dir.y), dz = _mm256_set1_ps(ray.dir.z);
+        __m256 zero = _mm256_setzero_ps(), tMin = _mm256_set1_ps(FLT_MAX), a = _mm256_set1_ps(dot(ray.dir, ray.dir));
+        __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), idxMin = _mm256_set1_epi32(-1), step = _mm256_set1_epi32(8);
+        for (int i = 0; i < n; i += 8) {
+            __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&cx[i]));
+            __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&cy[i]));
+            __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&cz[i]));
+            __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+            __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(&r2[i]));
+            __m256 discr = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, c));
+            __m256 sqrtDiscr = _mm256_sqrt_ps(_mm256_max_ps(discr, zero));
+            __m256 t1 = _mm256_sub_ps(sqrtDiscr, b), t2 = _mm256_sub_ps(_mm256_sub_ps(zero, b), sqrtDiscr);
+            __m256 t = _mm256_blendv_ps(t1, t2, _mm256_cmp_ps(t2, zero, _CMP_GT_OQ));
+            __m256 mask = _mm256_and_ps(_mm256_cmp_ps(discr, zero, _CMP_GE_OQ),
+                          _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, tMin, _CMP_LT_OQ)));
+            tMin = _mm256_blendv_ps(tMin, t, mask);
+            idxMin = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(idxMin), _mm256_castsi256_ps(idx), mask));
+            idx = _mm256_add_epi32(idx, step);
+        }
+        float ts[8]; int is[8];
+        _mm256_storeu_ps(ts, tMin);
+        _mm256_storeu_si256((__m256i *)is, idxMin);
+        for (int l = 0; l < 8; l++) if (is[l] >= 0 && ts[l] < tBest) { tBest = ts[l]; best = is[l]; }
+#elif defined(__SSE2__) || defined(_M_X64)
+        __m128 ox = _mm_set1_ps(ray.start.x), oy = _mm_set1_ps(ray.start.y), oz = _mm_set1_ps(ray.start.z);
+        __m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+        __m128 zero = _mm_setzero_ps(), tMin = _mm_set1_ps(FLT_MAX), a = _mm_set1_ps(dot(ray.dir, ray.dir));
+        __m128i idx = _mm_setr_epi32(0, 1, 2, 3), idxMin = _mm_set1_epi32(-1), step = _mm_set1_epi32(4);
+        for (int i = 0; i < n; i += 4) {
+            __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&cx[i]));
+            __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&cy[i]));
+            __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&cz[i]));
+            __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+            __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_loadu_ps(&r2[i]));
+            __m128 discr = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+            __m128 sqrtDiscr = _mm_sqrt_ps(_mm_max_ps(discr, zero));
+            __m128 t1 = _mm_sub_ps(sqrtDiscr, b), t2 = _mm_sub_ps(_mm_sub_ps(zero, b), sqrtDiscr);
+            __m128 front = _mm_cmpgt_ps(t2, zero);
+            __m128 t = _mm_or_ps(_mm_and_ps(front, t2), _mm_andnot_ps(front, t1));
+            __m128 mask = _mm_and_ps(_mm_cmpge_ps(discr, zero), _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, tMin)));
+            tMin = _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, tMin));
+            __m128i imask = _mm_castps_si128(mask);
+            idxMin = _mm_or_si128(_mm_and_si128(imask, idx), _mm_andnot_si128(imask, idxMin));
+            idx = _mm_add_epi32(idx, step);
+        }
+        float ts[4]; int is[4];
+        _mm_storeu_ps(ts, tMin);
+        _mm_storeu_si128((__m128i *)is, idxMin);
+        for (int l = 0; l < 4; l++) if (is[l] >= 0 && ts[l] < tBest) { tBest = ts[l]; best = is[l]; }
+#else
+        float a = dot(ray.dir, ray.dir);
+        for (int i = 0; i < n; i++) {
+            float ocx = ray.start.x - cx[i], ocy = ray.start.y - cy[i], ocz = ray.start.z - cz[i];
+            float b = ocx * ray.dir.x + ocy * ray.dir.y + ocz * ray.dir.z;
+            float discr = b * b - a * (ocx * ocx + ocy * ocy + ocz * ocz - r2[i]);
+            if (discr < 0) continue;
+            float sqrtDiscr = sqrtf(discr);
+            float t2 = -b - sqrtDiscr, t = (t2 > 0) ? t2 : sqrtDiscr - b;
+            if (t > 0 && t < tBest) { tBest = t; best = i; }
+        }
+#endif
+        if (best >= 0) tBest = tBest / dot(ray.dir, ray.dir);	// the roots are compared before the division by a > 0, which keeps their order
+        return best;
+    }
+};
+
+inline float rnd() { return (float)rand() / RAND_MAX; }
+
+const float epsilon = 0.0001f;
+
+inline vec3 Fresnel(vec3 F0, float cosTheta) {	// Schlick approximation
+    return F0 + (vec3(1, 1, 1) - F0) * powf(1 - cosTheta, 5);
+}
+
+inline float rayRandom(const Ray& ray, int depth) {	// uniform number that only depends on the ray
+    uint32_t bits[6];
+    memcpy(bits, &ray.start, sizeof(float) * 3);
+    memcpy(bits + 3, &ray.dir, sizeof(float) * 3);
+    uint32_t h = hash32(depth);
+    for (uint32_t b : bits) h = hashCombine(h, b);
+    return toUniform(h);
+}
+
+inline void tangentFrame(const vec3& normal, vec3& tangent, vec3& bitangent) {	// orthonormal basis (Duff et al.)
+    float sign = copysignf(1.0f, normal.z), a = -1.0f / (sign + normal.z), b = normal.x * normal.y * a;
+    tangent = vec3(1 + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+    bitangent = vec3(b, sign + normal.y * normal.y * a, -normal.y);
+}
+
+inline vec3 sampleCosine(const vec3& normal, vec2 u) {	// direction of the hemisphere with density cos / pi
+    vec3 tangent, bitangent;
+    tangentFrame(normal, tangent, bitangent);
+    float r = sqrtf(u.x), phi = 2 * M_PI * u.y;
+    return tangent * (r * cosf(phi)) + bitangent * (r * sinf(phi)) + normal * sqrtf(fmaxf(0.0f, 1 - u.x));
+}
+
+class ThreadPool;
+
+// Bounding volume hierarchy built with the binned surface area heuristic.
+// Nodes are stored depth first in one array: the left child of an inner node directly follows it,
+// the right child is at offset. Leaves reference a run of the reordered primitive array.
+// For moving primitives the tree is cut into subtrees of contiguous nodes and primitives below a few
+// top nodes; refit recomputes the boxes of the subtrees in parallel and rebuilds only those whose SAH
+// cost grew too much since they were built.
+class BVH {
+public:
+    struct Node {
+        AABB bounds;
+        int offset;		// right child for inner nodes, first primitive for leaves
+        int count;		// number of primitives, 0 for inner nodes
+    };
+private:
+    struct BuildPrimitive {
+        AABB bounds;
+        vec3 centroid;
+        PrimitiveRef ref;
+    };
+    struct StackEntry {
+        int node;
+        float t;
+    };
+    struct PacketStackEntry {
+        int node;
+        int first;		// first ray of the packet that may hit the node
+    };
+    struct Subtree {	// nodes [root, end) and primitives [first, first + count), refitted and rebuilt by one task
+        int root, end, depth;
+        int first, count;
+        float buildCost;	// SAH cost relative to the root area when the subtree was built
+    };
+
+    static const int nBins = 16;
+    static const int maxLeafSize = 8;
+    static const int maxDepth = 64;
+    static constexpr float traversalCost = 1.0f;	// relative to a primitive test
+
+    std::vector<Node> nodes;
+    const Primitives * store = nullptr;
+    std::vector<PrimitiveRef> primitives;
+    const Node * nodeArray = nullptr;	// traversed: nodes and primitives, or the arrays of a prebuilt tree
+    const PrimitiveRef * primitiveArray = nullptr;
+    int nNodes = 0, nPrimitives = 0;
+    std::vector<Subtree> subtrees;	// in depth first order
+    std::vector<int> topNodes;		// inner nodes above the subtrees, in depth first order
+    float buildCost = 0;			// SAH cost of the tree relative to the root area when it was built
+
+    int build(std::vector<BuildPrimitive>& prims, int begin, int end, int depth) {
+        int nodeIdx = (int)nodes.size();
+        nodes.push_back(Node());
+        AABB bounds, centroidBounds;
+        for (int i = begin; i < end; i++) {
+            bounds.grow(prims[i].bounds);
+            centroidBounds.grow(prims[i].centroid);
+        }
+        nodes[nodeIdx].bounds = bounds;
+        int count = end - begin;
+
+        // find the cheapest binned split over all three axes
+        float bestCost = FLT_MAX;
+        int bestAxis = -1, bestBin = 0;
+        for (int a = 0; a < 3 && count > 2; a++) {
+            float cmin = axis(centroidBounds.bmin, a), extent = axis(centroidBounds.bmax, a) - cmin;
+            if (extent <= 0) continue;
+            AABB binBounds[nBins];
+            int binCount[nBins] = { 0 };
+            float scale = nBins / extent;
+            for (int i = begin; i < end; i++) {
+                int b = std::min(nBins - 1, (int)((axis(prims[i].centroid, a) - cmin) * scale));
+                binBounds[b].grow(prims[i].bounds);
+                binCount[b]++;
+            }
+            float leftArea[nBins - 1];
+            int leftCount[nBins - 1];
+            AABB box;
+            int n = 0;
+            for (int b = 0; b < nBins - 1; b++) {
+                box.grow(binBounds[b]); n += binCount[b];
+                leftArea[b] = box.area(); leftCount[b] = n;
+            }
+            box = AABB(); n = 0;
+            for (int b = nBins - 1; b > 0; b--) {
+                box.grow(binBounds[b]); n += binCount[b];
+                if (n == 0 || leftCount[b - 1] == 0) continue;
+                float cost = leftArea[b - 1] * leftCount[b - 1] + box.area() * n;
+                if (cost < bestCost) { bestCost = cost; bestAxis = a; bestBin = b; }
+            }
+        }
+
+        float area = bounds.area();
+        bool split = bestAxis >= 0 && depth < maxDepth &&
+                     (count > maxLeafSize || traversalCost + bestCost / area < (float)count);
+        if (!split) {
+            nodes[nodeIdx].offset = (int)primitives.size();
+            nodes[nodeIdx].count = count;
+            for (int i = begin; i < end; i++) primitives.push_back(prims[i].ref);
+            return nodeIdx;
+        }
+
+        float cmin = axis(centroidBounds.bmin, bestAxis);
+        float scale = nBins / (axis(centroidBounds.bmax, bestAxis) - cmin);
+        BuildPrimitive * mid = std::partition(&prims[0] + begin, &prims[0] + end, [&](const BuildPrimitive& p) {
+            return std::min(nBins - 1, (int)((axis(p.centroid, bestAxis) - cmin) * scale)) < bestBin;
+        });
+        int midIdx = (int)(mid - &prims[0]);
+        build(prims, begin, midIdx, depth + 1);
+        int right = build(prims, midIdx, end, depth + 1);
+        nodes[nodeIdx].offset = right;
+        nodes[nodeIdx].count = 0;
+        return nodeIdx;
+    }
+
+    float areaCost(int root, int end) const {	// SAH cost of the nodes [root, end), not divided by the root area
+        float cost = 0;
+        for (int i = root; i < end; i++) cost += nodes[i].bounds.area() * (nodes[i].count > 0 ? (float)nodes[i].count : traversalCost);
+        return cost;
+    }
+
+    // cuts the tree into subtrees of at most maxSize primitives, with about 64 subtrees for large trees
+    void findSubtrees() {
+        subtrees.clear();
+        topNodes.clear();
+        buildCost = 0;
+        if (nodes.empty()) return;
+        std::vector<int> ends(nodes.size()), counts(nodes.size());	// children follow their parent
+        for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+            const Node& node = nodes[i];
+            ends[i] = (node.count > 0) ? i + 1 : ends[node.offset];
+            counts[i] = (node.count > 0) ? node.count : counts[i + 1] + counts[node.offset];
+        }
+        int maxSize = std::max((int)primitives.size() / 64, 256);
+        int stack[maxDepth + 1][2];	// node and depth
+        int sp = 0;
+        stack[sp][0] = 0; stack[sp++][1] = 0;
+        while (sp > 0) {
+            sp--;
+            int nodeIdx = stack[sp][0], depth = stack[sp][1];
+            const Node& node = nodes[nodeIdx];
+            if (counts[nodeIdx] > maxSize && node.count == 0) {
+                topNodes.push_back(nodeIdx);
+                stack[sp][0] = node.offset; stack[sp++][1] = depth + 1;
+                stack[sp][0] = nodeIdx + 1; stack[sp++][1] = depth + 1;
+                continue;
+            }
+            int leaf = nodeIdx;
+            while (nodes[leaf].count == 0) leaf++;	// the leftmost leaf holds the first primitive
+            float area = node.bounds.area();
+            Subtree subtree = { nodeIdx, ends[nodeIdx], depth, nodes[leaf].offset, counts[nodeIdx],
+                                area > 0 ? areaCost(nodeIdx, ends[nodeIdx]) / area : 0 };
+            subtrees.push_back(subtree);
+        }
+        float area = nodes[0].bounds.area();
+        buildCost = area > 0 ? areaCost(0, (int)nodes.size()) / area : 0;
+    }
+
+    void refitNodes(int root, int end) {	// children are refitted first, they follow their parent
+        for (int i = end - 1; i >= root; i--) {
+            Node& node = nodes[i];
+            if (node.count > 0) {
+                AABB bounds;
+                for (int p = node.offset; p < node.offset + node.count; p++)
+                    store->visit(primitives[p], [&](const auto& primitive) { bounds.grow(primitive.bounds()); });
+                node.bounds = bounds;
+            } else {
+                node.bounds = nodes[i + 1].bounds;
+                node.bounds.grow(nodes[node.offset].bounds);
+            }
+        }
+    }
+
+    std::vector<Node> rebuild(Subtree& subtree) {	// new nodes of the subtree, primitive offsets from subtree.first
+        std::vector<BuildPrimitive> prims(subtree.count);
+        for (int i = 0; i < subtree.count; i++) {
+            prims[i].ref = primitives[subtree.first + i];
+            store->visit(prims[i].ref, [&](const auto& primitive) { prims[i].bounds = primitive.bounds(); });
+            prims[i].centroid = prims[i].bounds.center();
+        }
+        BVH tree;
+        tree.store = store;
+        tree.nodes.reserve(2 * prims.size());
+        tree.build(prims, 0, subtree.count, subtree.depth);
+        std::copy(tree.primitives.begin(), tree.primitives.end(), primitives.begin() + subtree.first);
+        float area = tree.nodes[0].bounds.area();
+        subtree.buildCost = area > 0 ? tree.areaCost(0, (int)tree.nodes.size()) / area : 0;
+        return std::move(tree.nodes);
+    }
+
+    // appends the tree of nodeIdx to out with the rebuilt subtrees replacing the old ones, returns its new index
+    int splice(int nodeIdx, size_t& next, std::vector<std::vector<Node>>& rebuilt, std::vector<Node>& out) {
+        int outIdx = (int)out.size();
+        if (next < subtrees.size() && subtrees[next].root == nodeIdx) {
+            Subtree& subtree = subtrees[next];
+            const std::vector<Node>& fresh = rebuilt[next++];
+            const Node * src = fresh.empty() ? &nodes[subtree.root] : &fresh[0];
+            int n = fresh.empty() ? subtree.end - subtree.root : (int)fresh.size();
+            int nodeShift = fresh.empty() ? outIdx - subtree.root : outIdx, primitiveShift = fresh.empty() ? 0 : subtree.first;
+            for (int i = 0; i < n; i++) {
+                out.push_back(src[i]);
+                out.back().offset += (src[i].count > 0) ? primitiveShift : nodeShift;
+            }
+            subtree.root = outIdx;
+            subtree.end = (int)out.size();
+            return outIdx;
+        }
+        topNodes.push_back(outIdx);
+        out.push_back(nodes[nodeIdx]);
+        splice(nodeIdx + 1, next, rebuilt, out);
+        int right = splice(nodes[nodeIdx].offset, next, rebuilt, out);
+        out[outIdx].offset = right;
+        return outIdx;
+    }
+
+    void bind() {	// traverses the built arrays
+        nodeArray = nodes.data();
+        nNodes = (int)nodes.size();
+        primitiveArray = primitives.data();
+        nPrimitives = (int)primitives.size();
+    }
+
+public:
+    void build(const Primitives& _store) {
+        store = &_store;
+        nodes.clear();
+        primitives.clear();
+        if (store->size() == 0) {
+            bind();
+            findSubtrees();
+            return;
+        }
+        std::vector<BuildPrimitive> prims;
+        prims.reserve(store->size());
+        store->forEach([&](const auto& primitive, PrimitiveRef ref) {
+            BuildPrimitive prim;
+            prim.bounds = primitive.bounds();
+            prim.centroid = prim.bounds.center();
+            prim.ref = ref;
+            prims.push_back(prim);
+        });
+        nodes.reserve(2 * prims.size());
+        primitives.reserve(prims.size());
+        build(prims, 0, (int)prims.size(), 0);
+        bind();
+        findSubtrees();
+    }
+
+    // Traverses a prebuilt tree over the primitives of _store instead of building one, the arrays are not
+    // copied (until the first refit) and must outlive the BVH, e.g. the arrays of a mapped scene file.
+    // Returns false and keeps the BVH unchanged if the tree is malformed or refers to missing primitives.
+    bool attach(const Primitives& _store, const Node * _nodes, int _nNodes, const PrimitiveRef * _primitives, int _nPrimitives) {
+        if (_nNodes <= 0 || _nPrimitives < 0) return false;
+        // walks the tree from the root: every node must be reached exactly once, so shared children and cycles
+        // are rejected, and the depth along the walk bounds the stacks of the traversals
+        std::vector<char> visited(_nNodes, 0);
+        std::vector<std::pair<int, int>> stack(1, std::make_pair(0, 0));	// node and depth
+        int nVisited = 0;
+        while (!stack.empty()) {
+            int i = stack.back().first, depth = stack.back().second;
+            stack.pop_back();
+            if (visited[i]) return false;
+            visited[i] = 1;
+            nVisited++;
+            const Node& node = _nodes[i];
+            if (node.count > 0) {
+                if (node.offset < 0 || node.offset > _nPrimitives - node.count) return false;
+            } else {
+                if (node.count < 0 || i + 1 >= _nNodes || node.offset <= i + 1 || node.offset >= _nNodes || depth >= maxDepth) return false;
+                stack.push_back(std::make_pair(node.offset, depth + 1));
+                stack.push_back(std::make_pair(i + 1, depth + 1));
+            }
+        }
+        if (nVisited != _nNodes) return false;
+        for (int i = 0; i < _nPrimitives; i++) {
+            int kind = _primitives[i].kind;
+            if ((size_t)_primitives[i].index >= _store.size(kind) - _store.size(kind + 1)) return false;
+        }
+        store = &_store;
+        nodes.clear();
+        primitives.clear();
+        subtrees.clear();
+        topNodes.clear();
+        nodeArray = _nodes;
+        nNodes = _nNodes;
+        primitiveArray = _primitives;
+        nPrimitives = _nPrimitives;
+        return true;
+    }
+
+    // Fits the boxes to primitives that moved since the build, which must still be the same primitives.
+    // The subtrees are refitted on the threads of pool and rebuilt if their SAH cost exceeds
+    // rebuildThreshold times the cost they were built with; if the whole tree degrades that much, it is
+    // built again. Returns the number of subtrees rebuilt.
+    int refit(ThreadPool& pool, float rebuildThreshold);
+
+    int nodeCount() const { return nNodes; }
+    int primitiveCount() const { return nPrimitives; }
+    const Node * nodeData() const { return nodeArray; }
+    const PrimitiveRef * primitiveData() const { return primitiveArray; }
+    AABB bounds() const { return nNodes == 0 ? AABB() : nodeArray[0].bounds; }
+
+    // closest t and primitive, children are visited front to back and subtrees beyond the current best hit are skipped
+    Hit firstIntersect(const Ray& ray, float tLimit = FLT_MAX) const {	// hits beyond tLimit are not searched
+        Hit bestHit;
+        if (nNodes == 0) return bestHit;
+        RenderStats& stats = threadStats();
+        vec3 invDir(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+        StackEntry stack[maxDepth + 1];
+        int sp = 0;
+        float tRoot = nodeArray[0].bounds.intersect(ray, invDir, tLimit);
+        if (tRoot == FLT_MAX) return bestHit;
+        stack[sp++] = { 0, tRoot };
+        while (sp > 0) {
+            StackEntry entry = stack[--sp];
+            float tMax = (bestHit.t > 0) ? bestHit.t : tLimit;
+            if (entry.t >= tMax) continue;
+            int nodeIdx = entry.node;
+            for (;;) {
+                const Node& node = nodeArray[nodeIdx];
+                stats.nodesVisited++;
+                if (node.count > 0) {
+                    stats.intersectionTests += node.count;
+                    for (int i = node.offset; i < node.offset + node.count; i++) {
+                        store->visit(primitiveArray[i], [&](const auto& primitive) {
+                            float t = primitive.intersect(ray, (bestHit.t > 0) ? bestHit.t : tLimit);
+                            if (t > 0 && (bestHit.t < 0 || t < bestHit.t)) { bestHit.t = t; bestHit.primitive = primitiveArray[i]; }
+                        });
+                    }
+                    break;
+                }
+                tMax = (bestHit.t > 0) ? bestHit.t : tLimit;
+                int nearIdx = nodeIdx + 1, farIdx = node.offset;
+                float tNear = nodeArray[nearIdx].bounds.intersect(ray, invDir, tMax);
+                float tFar = nodeArray[farIdx].bounds.intersect(ray, invDir, tMax);
+                if (tFar < tNear) { std::swap(nearIdx, farIdx); std::swap(tNear, tFar); }
+                if (tNear == FLT_MAX) break;
+                if (tFar != FLT_MAX) stack[sp++] = { farIdx, tFar };
+                nodeIdx = nearIdx;
+            }
+        }
+        return bestHit;
+    }
+
+    // closest hits of a packet, a node is entered with the first ray that hits it and rays before it are skipped
+    void firstIntersect(RayPacket& packet) const {
+        if (nNodes == 0 || packet.count == 0) return;
+        RenderStats& stats = threadStats();
+        PacketStackEntry stack[maxDepth + 1];
+        int sp = 0;
+        stack[sp++] = { 0, 0 };
+        while (sp > 0) {
+            PacketStackEntry entry = stack[--sp];
+            int nodeIdx = entry.node;
+            const Node& node = nodeArray[nodeIdx];
+            stats.nodesVisited++;
+            int first = packet.firstActive(node.bounds, entry.first);
+            if (first == packet.count) continue;
+            if (node.count > 0) {
+                stats.intersectionTests += (uint64_t)(packet.count - first) * node.count;
+                for (int r = first; r < packet.count; r++) {
+                    Hit& bestHit = packet.hits[r];
+                    for (int i = node.offset; i < node.offset + node.count; i++) {
+                        store->visit(primitiveArray[i], [&](const auto& primitive) {
+                            float t = primitive.intersect(packet.rays[r], packet.tMax(r));
+                            if (t > 0 && (bestHit.t < 0 || t < bestHit.t)) { bestHit.t = t; bestHit.primitive = primitiveArray[i]; }
+                        });
+                    }
+                }
+                continue;
+            }
+            int nearIdx = nodeIdx + 1, farIdx = node.offset;	// ordered by the distance along the leading ray
+            float tMax = packet.tMax(first);
+            if (nodeArray[farIdx].bounds.intersect(packet.rays[first], packet.invDirs[first], tMax) <
+                nodeArray[nearIdx].bounds.intersect(packet.rays[first], packet.invDirs[first], tMax)) std::swap(nearIdx, farIdx);
+            stack[sp++] = { farIdx, first };
+            stack[sp++] = { nearIdx, first };
+        }
+    }
+
+    // any hit, the traversal stops at the first intersection found and returns the occluder, invalid if none
+    PrimitiveRef anyIntersect(const Ray& ray) const {
+        if (nNodes == 0) return PrimitiveRef();
+        RenderStats& stats = threadStats();
+        vec3 invDir(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+        int stack[maxDepth + 1];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0) {
+            int nodeIdx = stack[--sp];
+            const Node& node = nodeArray[nodeIdx];
+            stats.nodesVisited++;
+            if (node.bounds.intersect(ray, invDir, FLT_MAX) == FLT_MAX) continue;
+            if (node.count > 0) {
+                for (int i = node.offset; i < node.offset + node.count; i++) {
+                    stats.intersectionTests++;
+                    bool occluded = false;
+                    store->visit(primitiveArray[i], [&](const auto& primitive) { occluded = primitive.occluded(ray); });
+                    if (occluded) return primitiveArray[i];
+                }
+            } else {
+                stack[sp++] = node.offset;
+                stack[sp++] = nodeIdx + 1;
+            }
+        }
+        return PrimitiveRef();
+    }
+};
+
+// Geometry shared by instances: primitives in model coordinates with their own bottom-level BVH.
+// Models are built by Scene::commit after primitives were added.
+struct Model {
+    Primitives primitives;
+    BVH bvh;
+    bool dirty = true;		// primitives were added since the BVH was built
+
+    template <class Kind> PrimitiveRef add(const Kind& primitive) {
+        dirty = true;
+        return primitives.add(primitive);
+    }
+};
+
+inline float Instance::intersect(const Ray& ray, float tMax) const { return model->bvh.firstIntersect(modelRay(ray), tMax).t; }
+
+// the closest hit is searched again in model space, only the closest hit of a ray gets its surface
+inline void Instance::surface(const Ray& ray, Hit& hit) const {
+    Ray local = modelRay(ray);
+    Hit inner = model->bvh.firstIntersect(local);
+    inner.t = hit.t;
+    model->primitives.visit(inner.primitive, [&](const auto& primitive) { primitive.surface(local, inner); });
+    hit.position = ray.start + ray.dir * hit.t;
+    vec3 n = inner.normal;	// normals transform by the inverse transpose
+    hit.normal = normalize(vec3(toModel[0].x * n.x + toModel[0].y * n.y + toModel[0].z * n.z,
+                                toModel[1].x * n.x + toModel[1].y * n.y + toModel[1].z * n.z,
+                                toModel[2].x * n.x + toModel[2].y * n.y + toModel[2].z * n.z));
+    hit.material = material ? material : inner.material;
+}
+
+inline bool Instance::occluded(const Ray& ray) const { return model->bvh.anyIntersect(modelRay(ray)).valid(); }
+
+inline AABB Instance::bounds() const {	// world box of the corners of the model box
+    AABB local = model->bvh.bounds(), box;
+    if (local.bmax.x < local.bmin.x) return box;
+    for (int c = 0; c < 8; c++)
+        box.grow(transformPoint(vec3((c & 1) ? local.bmax.x : local.bmin.x, (c & 2) ? local.bmax.y : local.bmin.y,
+                                     (c & 4) ? local.bmax.z : local.bmin.z), toWorld));
+    return box;
+}
+
+// Four-wide BVH collapsed from the binary BVH: a node keeps the boxes of its four children quantized to
+// 8 bits relative to its own box, so it fits a cache line (64 bytes against 4 x 32 for the binary nodes it
+// replaces), and the four children are tested by one SIMD slab test. The quantized boxes are rounded
+// outwards and the scales are powers of two, so origin + q * scale is exact up to one rounding and the
+// boxes always enclose the children.
+class WideBVH {
+public:
+    static const int width = 4;
+    struct Node {
+        vec3 origin;						// child boxes are origin + q * 2^exponent on every axis
+        int8_t exponent[3];
+        uint8_t count[width];				// primitives of a leaf child, 0 for inner children
+        uint8_t lo[3][width], hi[3][width];	// quantized child boxes, axis major for one load per axis
+        int child[width];					// node of an inner child, first primitive of a leaf, -1 if empty
+        char padding[4];					// to a cache line
+    };
+    static_assert(sizeof(Node) == 64, "a node is one cache line");
+private:
+    struct StackEntry {
+        int node;
+        float t;
+    };
+    struct Child {		// child candidate of a node while collapsing
+        AABB bounds;
+        int node;		// inner node of the binary tree, -1 for primitives [first, first + count)
+        int first, count;
+    };
+
+    static const int maxLeafSize = 255;		// larger binary leaves are split
+    static const int maxDepth = 96;			// 64 of the binary tree and the splits of its leaves
+    std::vector<Node> storage;				// one spare node to align the first one to a cache line
+    Node * nodeArray = nullptr;
+    int nNodes = 0;
+    std::vector<Node> nodes;				// while building
+    std::vector<PrimitiveRef> primitives;	// in leaf order
+    const Primitives * store = nullptr;
+
+    static float power2(int e) {	// 2^e of a normal float
+        uint32_t bits = (uint32_t)(e + 127) << 23;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    Child child(const BVH& bvh, int i) const {
+        const BVH::Node& node = bvh.nodeData()[i];
+        return { node.bounds, node.count > 0 ? -1 : i, node.offset, node.count };
+    }
+
+    Child leaf(const BVH& bvh, int first, int count) const {
+        Child leaf = { AABB(), -1, first, count };
+        for (int p = first; p < first + count; p++) store->visit(bvh.primitiveData()[p], [&](const auto& primitive) { leaf.bounds.grow(primitive.bounds()); });
+        return leaf;
+    }
+
+    void quantize(Node& node, const AABB& bounds, const Child * children, int nChildren) {
+        node.origin = bounds.bmin;
+        for (int a = 0; a < 3; a++) {
+            float o = axis(bounds.bmin, a), extent = axis(bounds.bmax, a) - o;
+            int e = (extent > 0) ? std::max((int)ceilf(log2f(extent / 255)), -126) : -126;
+            while (e < 127 && o + 255 * power2(e) < axis(bounds.bmax, a)) e++;
+            node.exponent[a] = (int8_t)e;
+            float scale = power2(e);
+            for (int c = 0; c < width; c++) {
+                if (c >= nChildren) {
+                    node.lo[a][c] = node.hi[a][c] = 0;
+                    continue;
+                }
+                float cmin = axis(children[c].bounds.bmin, a), cmax = axis(children[c].bounds.bmax, a);
+                int lo = std::min(std::max((int)floorf((cmin - o) / scale), 0), 255);
+                int hi = std::min(std::max((int)ceilf((cmax - o) / scale), 0), 255);
+                while (lo > 0 && o + lo * scale > cmin) lo--;
+                while (hi < 255 && o + hi * scale < cmax) hi++;
+                node.lo[a][c] = (uint8_t)lo;
+                node.hi[a][c] = (uint8_t)hi;
+            }
+        }
+    }
+
+    // new node of the children, the child of the largest area is opened until the node is full
+    int collapse(const BVH& bvh, std::vector<Child> children) {
+        while ((int)children.size() < width) {
+            int best = -1;
+            float bestArea = -1;
+            for (int c = 0; c < (int)children.size(); c++) {
+                bool open = children[c].node >= 0 || children[c].count > maxLeafSize;
+                if (open && children[c].bounds.area() > bestArea) { best = c; bestArea = children[c].bounds.area(); }
+            }
+            if (best < 0) break;
+            Child opened = children[best];
+            Child halves[2];
+            if (opened.node >= 0) {
+                halves[0] = child(bvh, opened.node + 1);
+                halves[1] = child(bvh, bvh.nodeData()[opened.node].offset);
+            } else {
+                halves[0] = leaf(bvh, opened.first, opened.count / 2);
+                halves[1] = leaf(bvh, opened.first + opened.count / 2, opened.count - opened.count / 2);
+            }
+            children[best] = halves[0];
+            children.insert(children.begin() + best + 1, halves[1]);
+        }
+        int nodeIdx = (int)nodes.size();
+        nodes.push_back(Node());
+        AABB bounds;
+        for (const Child& c : children) bounds.grow(c.bounds);
+        quantize(nodes[nodeIdx], bounds, children.data(), (int)children.size());
+        for (int c = 0; c < width; c++) {
+            int childIdx = -1, count = 0;
+            if (c < (int)children.size() && children[c].node < 0) {
+                childIdx = (int)primitives.size();
+                count = children[c].count;
+                primitives.insert(primitives.end(), bvh.primitiveData() + children[c].first, bvh.primitiveData() + children[c].first + count);
+            } else if (c < (int)children.size()) {
+                childIdx = collapse(bvh, { child(bvh, children[c].node + 1), child(bvh, bvh.nodeData()[children[c].node].offset) });
+            }
+            nodes[nodeIdx].child[c] = childIdx;
+            nodes[nodeIdx].count[c] = (uint8_t)count;
+        }
+        return nodeIdx;
+    }
+
+    // entry distances of the children that the ray hits closer than tMax, FLT_MAX for the others
+    void intersectChildren(const Node& node, const Ray& ray, const vec3& invDir, float tMax, float tNear[width]) const {
+#if defined(__SSE2__) || defined(_M_X64)
+        __m128 tEntry = _mm_set1_ps(-FLT_MAX), tExit = _mm_set1_ps(FLT_MAX);
+        __m128i zero = _mm_setzero_si128();
+        for (int a = 0; a < 3; a++) {
+            int32_t lo, hi;
+            memcpy(&lo, node.lo[a], 4);
+            memcpy(&hi, node.hi[a], 4);
+            __m128 qlo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lo), zero), zero));
+            __m128 qhi = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hi), zero), zero));
+            __m128 origin = _mm_set1_ps(axis(node.origin, a)), scale = _mm_set1_ps(power2(node.exponent[a]));
+            __m128 start = _mm_set1_ps(axis(ray.start, a)), inv = _mm_set1_ps(axis(invDir, a));
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(qlo, scale)), start), inv);
+            __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(qhi, scale)), start), inv);
+            tEntry = _mm_max_ps(_mm_min_ps(t1, t2), tEntry);	// a NaN slab (0 * inf) keeps the previous value
+            tExit = _mm_min_ps(_mm_max_ps(t1, t2), tExit);
+        }
+        __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(tExit, tEntry), _mm_cmpgt_ps(tExit, _mm_setzero_ps())),
+                                _mm_cmplt_ps(tEntry, _mm_set1_ps(tMax)));
+        hit = _mm_and_ps(hit, _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)node.child), _mm_set1_epi32(-1))));
+        _mm_storeu_ps(tNear, _mm_or_ps(_mm_and_ps(hit, tEntry), _mm_andnot_ps(hit, _mm_set1_ps(FLT_MAX))));
+#else
+        for (int c = 0; c < width; c++) {
+            AABB box;
+            for (int a = 0; a < 3; a++) {
+                float origin = axis(node.origin, a), scale = power2(node.exponent[a]);
+                axis(box.bmin, a) = origin + node.lo[a][c] * scale;
+                axis(box.bmax, a) = origin + node.hi[a][c] * scale;
+            }
+            tNear[c] = (node.child[c] >= 0) ? box.intersect(ray, invDir, tMax) : FLT_MAX;
+        }
+#endif
+    }
+
+public:
+    void build(const BVH& bvh, const Primitives& _store) {	// collapses a built binary BVH of _store
+        store = &_store;
+        nodes.clear();
+        primitives.clear();
+        if (bvh.nodeCount() > 0) collapse(bvh, { child(bvh, 0) });
+        storage.resize(nodes.size() + 1);
+        nodeArray = (Node *)(((uintptr_t)storage.data() + 63) & ~(uintptr_t)63);
+        std::copy(nodes.begin(), nodes.end(), nodeArray);
+        nNodes = (int)nodes.size();
+        nodes = std::vector<Node>();
+    }
+
+    int nodeCount() const { return nNodes; }
+    size_t memoryBytes() const { return nNodes * sizeof(Node) + primitives.size() * sizeof(PrimitiveRef); }
+
+    // closest t and primitive, the leaves of a node are tested before its inner children are pushed far to near
+    Hit firstIntersect(const Ray& ray, float tLimit = FLT_MAX) const {
+        Hit bestHit;
+        if (nNodes == 0) return bestHit;
+        RenderStats& stats = threadStats();
+        vec3 invDir(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+        StackEntry stack[(width - 1) * maxDepth + 1];
+        int sp = 0;
+        stack[sp++] = { 0, -FLT_MAX };
+        while (sp > 0) {
+            StackEntry entry = stack[--sp];
+            float tMax = (bestHit.t > 0) ? bestHit.t : tLimit;
+            if (entry.t >= tMax) continue;
+            const Node& node = nodeArray[entry.node];
+            stats.nodesVisited++;
+            float tNear[width];
+            intersectChildren(node, ray, invDir, tMax, tNear);
+            int order[width] = { 0, 1, 2, 3 };	// near to far
+            for (int i = 1; i < width; i++)
+                for (int j = i; j > 0 && tNear[order[j]] < tNear[order[j - 1]]; j--) std::swap(order[j], order[j - 1]);
+            for (int i = 0; i < width && tNear[order[i]] != FLT_MAX; i++) {
+                int c = order[i];
+                if (node.count[c] == 0 || tNear[c] >= ((bestHit.t > 0) ? bestHit.t : tLimit)) continue;
+                stats.intersectionTests += node.count[c];
+                for (int p = node.child[c]; p < node.child[c] + node.count[c]; p++) {
+                    store->visit(primitives[p], [&](const auto& primitive) {
+                        float t = primitive.intersect(ray, (bestHit.t > 0) ? bestHit.t : tLimit);
+                        if (t > 0 && (bestHit.t < 0 || t < bestHit.t)) { bestHit.t = t; bestHit.primitive = primitives[p]; }
+                    });
+                }
+            }
+            for (int i = width - 1; i >= 0; i--) {
+                int c = order[i];
+                if (tNear[c] != FLT_MAX && node.count[c] == 0) stack[sp++] = { node.child[c], tNear[c] };
+            }
+        }
+        return bestHit;
+    }
+
+    // any hit, the traversal stops at the first intersection found and returns the occluder, invalid if none
+    PrimitiveRef anyIntersect(const Ray& ray) const {
+        if (nNodes == 0) return PrimitiveRef();
+        RenderStats& stats = threadStats();
+        vec3 invDir(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+        int stack[(width - 1) * maxDepth + 1];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0) {
+            const Node& node = nodeArray[stack[--sp]];
+            stats.nodesVisited++;
+            float tNear[width];
+            intersectChildren(node, ray, invDir, FLT_MAX, tNear);
+            for (int c = 0; c < width; c++) {
+                if (tNear[c] == FLT_MAX) continue;
+                if (node.count[c] == 0) {
+                    stack[sp++] = node.child[c];
+                    continue;
+                }
+                for (int p = node.child[c]; p < node.child[c] + node.count[c]; p++) {
+                    stats.intersectionTests++;
+                    bool occluded = false;
+                    store->visit(primitives[p], [&](const auto& primitive) { occluded = primitive.occluded(ray); });
+                    if (occluded) return primitives[p];
+                }
+            }
+        }
+        return PrimitiveRef();
+    }
+};
+
+// Persistent worker threads running the tasks [0, nTasks) of a job. Every worker owns a deque that is
+// filled with a contiguous block of tasks; a worker takes tasks from the back of its own deque and, once
+// it is empty, steals from the front of the others. The calling thread works as worker 0.
+class ThreadPool {
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::thread> threads;
+    std::vector<WorkQueue> queues;
+    std::function<void(int task, int worker)> job;
+    std::mutex mutex;
+    std::condition_variable startCondition, doneCondition;
+    int generation = 0, busy = 0;
+    bool quit = false;
+
+    bool pop(int worker, int& task) {
+        {
+            WorkQueue& own = queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            WorkQueue& victim = queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int worker) {
+        int task;
+        while (pop(worker, task)) job(task, worker);
+    }
+
+    void loop(int worker) {
+        int seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            startCondition.wait(lock, [&] { return quit || generation != seen; });
+            if (quit) return;
+            seen = generation;
+            lock.unlock();
+            work(worker);
+            lock.lock();
+            if (--busy == 0) doneCondition.notify_all();
+        }
+    }
+public:
+    ThreadPool(int nThreads = 0) : queues(nThreads > 0 ? nThreads : std::max(1u, std::thread::hardware_concurrency())) {
+        for (int w = 1; w < size(); w++) threads.push_back(std::thread(&ThreadPool::loop, this, w));
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        startCondition.notify_all();
+        for (std::thread& thread : threads) thread.join();
+    }
+
+    int size() const { return (int)queues.size(); }
+
+    void run(int nTasks, const std::function<void(int task, int worker)>& _job) {
+        job = _job;
+        for (int w = 0; w < size(); w++) {
+            std::lock_guard<std::mutex> lock(queues[w].mutex);
+            for (int task = nTasks * w / size(); task < nTasks * (w + 1) / size(); task++) queues[w].tasks.push_back(task);
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        busy = size() - 1;
+        generation++;
+        startCondition.notify_all();
+        lock.unlock();
+        work(0);
+        lock.lock();
+        doneCondition.wait(lock, [&] { return busy == 0; });
+    }
+};
+
+inline int BVH::refit(ThreadPool& pool, float rebuildThreshold) {
+    if (nNodes == 0) return 0;
+    if (nodes.empty()) {	// an attached tree is copied first
+        nodes.assign(nodeArray, nodeArray + nNodes);
+        primitives.assign(primitiveArray, primitiveArray + nPrimitives);
+        bind();
+        findSubtrees();
+    }
+    std::vector<float> costs(subtrees.size());
+    std::vector<std::vector<Node>> rebuilt(subtrees.size());
+    pool.run((int)subtrees.size(), [&](int task, int) {
+        Subtree& subtree = subtrees[task];
+        refitNodes(subtree.root, subtree.end);
+        costs[task] = areaCost(subtree.root, subtree.end);
+        float area = nodes[subtree.root].bounds.area();
+        if (costs[task] <= rebuildThreshold * subtree.buildCost * area) return;
+        rebuilt[task] = rebuild(subtree);
+        costs[task] = subtree.buildCost * area;
+    });
+    float cost = 0;
+    for (float c : costs) cost += c;
+    for (int i = (int)topNodes.size() - 1; i >= 0; i--) {
+        Node& node = nodes[topNodes[i]];
+        node.bounds = nodes[topNodes[i] + 1].bounds;
+        node.bounds.grow(nodes[node.offset].bounds);
+        cost += node.bounds.area() * traversalCost;
+    }
+    if (cost > rebuildThreshold * buildCost * nodes[0].bounds.area()) {
+        build(*store);
+        return (int)subtrees.size();
+    }
+    int nRebuilt = 0;
+    for (const std::vector<Node>& fresh : rebuilt) if (!fresh.empty()) nRebuilt++;
+    if (nRebuilt == 0) return 0;
+    std::vector<Node> out;
+    out.reserve(nodes.size());
+    size_t next = 0;
+    topNodes.clear();
+    splice(0, next, rebuilt, out);
+    nodes.swap(out);
+    bind();
+    return nRebuilt;
+}
+
+// Storage of the scene entities (materials, lights, meshes, models). Objects of one type are placed one
+// after the other in blocks of that type, so the entities used together share cache lines instead of
+// being scattered over the heap. Nothing is freed one by one: clear destroys all objects at once, only
+// the types with destructors are visited, and keeps the blocks for the next build.
+class Arena {
+    static const size_t blockSize = 1 << 16;
+    struct Pool {			// blocks of one type
+        std::vector<void *> blocks;
+        size_t objectSize = 0, blockCapacity = 0;
+        size_t count = 0;	// objects in use, the first count slots over the blocks
+        void (*destroy)(void *) = nullptr;	// null for trivially destructible types
+
+        void * allocate() {
+            size_t block = count / blockCapacity, slot = count % blockCapacity;
+            if (block == blocks.size()) blocks.push_back(::operator new(objectSize * blockCapacity));
+            count++;
+            return (char *)blocks[block] + slot * objectSize;
+        }
+        void clear() {
+            if (destroy) for (size_t i = count; i-- > 0;) destroy((char *)blocks[i / blockCapacity] + i % blockCapacity * objectSize);
+            count = 0;
+        }
+    };
+    std::vector<Pool> pools;	// indexed by typeIndex
+
+    static int nextTypeIndex() {
+        static std::atomic<int> n(0);
+        return n++;
+    }
+    template <class T> static int typeIndex() {	// dense index of T, the same in every arena
+        static const int index = nextTypeIndex();
+        return index;
+    }
+public:
+    Arena() { }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() {
+        clear();
+        for (Pool& pool : pools)
+            for (void * block : pool.blocks) ::operator delete(block);
+    }
+
+    template <class T, class... Args> T * make(Args&&... args) {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "blocks are aligned for the fundamental types only");
+        int index = typeIndex<T>();
+        if (index >= (int)pools.size()) pools.resize(index + 1);
+        Pool& pool = pools[index];
+        if (pool.objectSize == 0) {
+            pool.objectSize = sizeof(T);
+            pool.blockCapacity = std::max(blockSize / sizeof(T), (size_t)1);
+            if (!std::is_trivially_destructible<T>::value) pool.destroy = [](void * object) { ((T *)object)->~T(); };
+        }
+        return new (pool.allocate()) T(std::forward<Args>(args)...);
+    }
+
+    void clear() { for (Pool& pool : pools) pool.clear(); }
+};
+
+inline bool boundingSphere(const Sphere& sphere, vec3& center, float& radius) {
+    center = sphere.center;
+    radius = sphere.radius;
+    return true;
+}
+
+template <class Kind> bool boundingSphere(const Kind& primitive, vec3& center, float& radius) {	// around the box, false if empty
+    AABB box = primitive.bounds();
+    if (box.bmax.x < box.bmin.x) return false;
+    center = box.center();
+    radius = length(box.bmax - box.bmin) * 0.5f;
+    return true;
+}
+
+// Primitives listed by the RayPacket tiles of the image their bounding sphere projects onto. The camera
+// rays of a tile can only hit the primitives of its list, so primary rays test a few primitives without
+// a BVH. Built again for every frame: the primitives are binned in parallel by a counting sort, the bins
+// keep the order of the primitives.
+class ScreenBins {
+    struct Rect {
+        int16_t X0, Y0, X1, Y1;	// bins covered, X0 > X1 if none
+    };
+    int nBinsX = 0, nBinsY = 0;
+    std::vector<int> first;				// nBins + 1 offsets into refs
+    std::vector<PrimitiveRef> refs;
+    std::vector<Rect> rects;			// of the primitives in the order of the store
+    std::vector<int> counts;			// of each task in each bin, then the write positions
+public:
+    static const int binSize = RayPacket::tileSize;
+
+    void build(const Primitives& primitives, const Camera& camera, int width, int height, ThreadPool& pool) {
+        nBinsX = (width + binSize - 1) / binSize;
+        nBinsY = (height + binSize - 1) / binSize;
+        int nBins = nBinsX * nBinsY;
+        size_t n = primitives.size();
+        int nTasks = (int)std::min((size_t)pool.size() * 4, n / 1024 + 1);
+        rects.resize(n);
+        counts.assign((size_t)nTasks * nBins, 0);
+        auto forRange = [&](int task, auto&& f) {	// f(i, ref) for the primitives of task in store order
+            size_t begin = n * task / nTasks, end = n * (task + 1) / nTasks;
+            int kind = 0;
+            size_t kindStart = 0;
+            for (size_t i = begin; i < end; i++) {
+                while (i >= n - primitives.size(kind + 1)) kindStart = n - primitives.size(++kind);
+                f(i, PrimitiveRef(kind, (int)(i - kindStart)));
+            }
+        };
+        pool.run(nTasks, [&](int task, int) {
+            int * count = &counts[(size_t)task * nBins];
+            forRange(task, [&](size_t i, PrimitiveRef ref) {
+                Rect& rect = rects[i];
+                rect = { 0, 0, -1, -1 };
+                vec3 center;
+                float radius;
+                int X0, Y0, X1, Y1;
+                bool visible = false;
+                primitives.visit(ref, [&](const auto& primitive) { visible = boundingSphere(primitive, center, radius); });
+                if (!visible || !camera.pixelBounds(center, radius, X0, Y0, X1, Y1)) return;
+                rect = { (int16_t)(X0 / binSize), (int16_t)(Y0 / binSize), (int16_t)(X1 / binSize), (int16_t)(Y1 / binSize) };
+                for (int BY = rect.Y0; BY <= rect.Y1; BY++)
+                    for (int BX = rect.X0; BX <= rect.X1; BX++) count[BY * nBinsX + BX]++;
+            });
+        });
+        first.resize(nBins + 1);
+        int total = 0;
+        for (int bin = 0; bin < nBins; bin++) {	// counts become the positions the tasks write their part of the bin to
+            first[bin] = total;
+            for (int task = 0; task < nTasks; task++) {
+                int count = counts[(size_t)task * nBins + bin];
+                counts[(size_t)task * nBins + bin] = total;
+                total += count;
+            }
+        }
+        first[nBins] = total;
+        refs.resize(total);
+        pool.run(nTasks, [&](int task, int) {
+            int * next = &counts[(size_t)task * nBins];
+            forRange(task, [&](size_t i, PrimitiveRef ref) {
+                const Rect& rect = rects[i];
+                for (int BY = rect.Y0; BY <= rect.Y1; BY++)
+                    for (int BX = rect.X0; BX <= rect.X1; BX++) refs[next[BY * nBinsX + BX]++] = ref;
+            });
+        });
+    }
+
+    void get(int X, int Y, const PrimitiveRef *& begin, const PrimitiveRef *& end) const {	// list of the bin of pixel (X, Y)
+        int bin = (Y / binSize) * nBinsX + X / binSize;
+        begin = refs.data() + first[bin];
+        end = refs.data() + first[bin + 1];
+    }
+};
+
+// Occluders of a directional light listed by the cells of a grid in the plane perpendicular to the light.
+// A shadow ray keeps its position in that plane, so it can only hit the primitives whose bounding sphere
+// projects onto the cell of its origin and reaches above the origin towards the light. The occluders of
+// a cell are sorted by their top and the query stops at the first one below the origin. A cell inside
+// the shadow of a sphere answers the rays starting below the sphere without a test and lists only the
+// occluders above it, the ones whose disk misses the origin are skipped before the exact test.
+// Built again whenever the geometry changes.
+class ShadowGrid {
+    struct Occluder {		// bounding sphere of a primitive in light space
+        float x, y, radius2;	// disk, with the margin
+        float top;				// towards the light
+        PrimitiveRef ref;
+    };
+    struct Cell {
+        int first = 0, count = 0;
+        float cover = -FLT_MAX;	// rays starting lower are blocked by a sphere covering the cell
+    };
+    struct Disk {
+        float x, y, depth, radius;
+        bool empty, solid;	// solid: the primitive is the sphere itself
+    };
+    vec3 direction, u, v;	// towards the light and the axes of the grid
+    float x0 = 0, y0 = 0, cellSize = 1, margin = 0;	// margin against the rounding of the projections
+    int nx = 0, ny = 0;
+    std::vector<Cell> cells;
+    std::vector<Occluder> occluders;
+    std::vector<PrimitiveRef> refs;	// of all primitives in store order
+    std::vector<Disk> disks;
+
+    static bool solid(const Sphere&) { return true; }
+    template <class Kind> static bool solid(const Kind&) { return false; }
+
+    template <class F> void forCells(const Disk& disk, F&& f) const {	// f(cell) for the cells the disk reaches
+        float r = disk.radius + margin, x = disk.x - x0, y = disk.y - y0;
+        int CX0 = std::max((int)floorf((x - r) / cellSize), 0), CX1 = std::min((int)floorf((x + r) / cellSize), nx - 1);
+        int CY0 = std::max((int)floorf((y - r) / cellSize), 0), CY1 = std::min((int)floorf((y + r) / cellSize), ny - 1);
+        for (int CY = CY0; CY <= CY1; CY++) {
+            float dy = std::max(std::max(CY * cellSize - y, y - (CY + 1) * cellSize), 0.0f);
+            for (int CX = CX0; CX <= CX1; CX++) {
+                float dx = std::max(std::max(CX * cellSize - x, x - (CX + 1) * cellSize), 0.0f);
+                if (dx * dx + dy * dy <= r * r) f(CY * nx + CX);
+            }
+        }
+    }
+
+    float coverBottom(const Disk& disk, int c) const {	// of a solid disk containing cell c, -FLT_MAX otherwise
+        int CX = c % nx, CY = c / nx;
+        float x = disk.x - x0, y = disk.y - y0, r = disk.radius - margin;
+        float dx = std::max(x - CX * cellSize, (CX + 1) * cellSize - x), dy = std::max(y - CY * cellSize, (CY + 1) * cellSize - y);
+        return (disk.solid && r > 0 && dx * dx + dy * dy < r * r) ? disk.depth - disk.radius - margin : -FLT_MAX;
+    }
+
+    float top(const Disk& disk) const { return disk.depth + disk.radius + margin; }
+
+public:
+    void build(const Primitives& primitives, const vec3& lightDirection, ThreadPool& pool) {
+        direction = normalize(lightDirection);
+        u = normalize(cross(fabsf(direction.x) < 0.9f ? vec3(1, 0, 0) : vec3(0, 1, 0), direction));
+        v = cross(direction, u);
+        size_t n = primitives.size();
+        refs.resize(n);
+        disks.resize(n);
+        for (int kind = 0, i = 0; i < (int)n; kind++)
+            for (int j = 0; j < (int)(primitives.size(kind) - primitives.size(kind + 1)); j++) refs[i++] = PrimitiveRef(kind, j);
+        int nTasks = (int)std::min((size_t)pool.size() * 4, n / 1024 + 1);
+        struct Extent {
+            AABB box;		// x and y of the disks
+            double radiusSum = 0;
+            size_t count = 0;
+        };
+        std::vector<Extent> extents(nTasks);
+        pool.run(nTasks, [&](int task, int) {
+            Extent& extent = extents[task];
+            for (size_t i = n * task / nTasks; i < n * (task + 1) / nTasks; i++) {
+                Disk& disk = disks[i];
+                vec3 center;
+                disk.radius = 0;
+                disk.solid = false;
+                primitives.visit(refs[i], [&](const auto& primitive) {
+                    disk.empty = !boundingSphere(primitive, center, disk.radius);
+                    disk.solid = solid(primitive);
+                });
+                disk.x = dot(center, u);
+                disk.y = dot(center, v);
+                disk.depth = dot(center, direction);
+                if (disk.empty) continue;
+                extent.box.grow(vec3(disk.x - disk.radius, disk.y - disk.radius, 0));
+                extent.box.grow(vec3(disk.x + disk.radius, disk.y + disk.radius, 0));
+                extent.radiusSum += disk.radius;
+                extent.count++;
+            }
+        });
+        Extent total;
+        for (const Extent& extent : extents) {
+            total.box.grow(extent.box);
+            total.radiusSum += extent.radiusSum;
+            total.count += extent.count;
+        }
+        cells.clear();
+        occluders.clear();
+        nx = ny = 0;
+        if (total.count == 0) return;
+        // cells of the mean radius: a sphere reaches a few cells, and in crowded parts of the scene most
+        // cells lie in the shadow of some sphere
+        float width = total.box.bmax.x - total.box.bmin.x, height = total.box.bmax.y - total.box.bmin.y;
+        margin = 1e-4f * std::max(std::max(width, height), 1e-3f);
+        cellSize = std::max((float)(total.radiusSum / total.count), (std::max(width, height) + 2 * margin) / 4096);
+        x0 = total.box.bmin.x - margin;
+        y0 = total.box.bmin.y - margin;
+        nx = std::min((int)((width + 2 * margin) / cellSize) + 1, 4096);
+        ny = std::min((int)((height + 2 * margin) / cellSize) + 1, 4096);
+        size_t nCells = (size_t)nx * ny;
+        cells.resize(nCells);
+        // the covers of the cells first, then only the occluders reaching above the cover are listed
+        std::unique_ptr<std::atomic<float>[]> covers(new std::atomic<float>[nCells]);
+        std::unique_ptr<std::atomic<int>[]> counts(new std::atomic<int>[nCells]);
+        for (size_t c = 0; c < nCells; c++) {
+            covers[c].store(-FLT_MAX, std::memory_order_relaxed);
+            counts[c].store(0, std::memory_order_relaxed);
+        }
+        pool.run(nTasks, [&](int task, int) {
+            for (size_t i = n * task / nTasks; i < n * (task + 1) / nTasks; i++) {
+                if (disks[i].empty || !disks[i].solid) continue;
+                forCells(disks[i], [&](int c) {
+                    float bottom = coverBottom(disks[i], c), cover = covers[c].load(std::memory_order_relaxed);
+                    while (bottom > cover && !covers[c].compare_exchange_weak(cover, bottom, std::memory_order_relaxed)) { }
+                });
+            }
+        });
+        pool.run(nTasks, [&](int task, int) {
+            for (size_t i = n * task / nTasks; i < n * (task + 1) / nTasks; i++) {
+                if (disks[i].empty) continue;
+                float diskTop = top(disks[i]);
+                forCells(disks[i], [&](int c) {
+                    if (diskTop > covers[c].load(std::memory_order_relaxed)) counts[c].fetch_add(1, std::memory_order_relaxed);
+                });
+            }
+        });
+        int nOccluders = 0;
+        for (size_t c = 0; c < nCells; c++) {	// counts become the write positions of the cells
+            int count = counts[c].load(std::memory_order_relaxed);
+            cells[c].first = nOccluders;
+            cells[c].count = count;
+            cells[c].cover = covers[c].load(std::memory_order_relaxed);
+            counts[c].store(nOccluders, std::memory_order_relaxed);
+            nOccluders += count;
+        }
+        occluders.resize(nOccluders);
+        pool.run(nTasks, [&](int task, int) {
+            for (size_t i = n * task / nTasks; i < n * (task + 1) / nTasks; i++) {
+                const Disk& disk = disks[i];
+                if (disk.empty) continue;
+                float r = disk.radius + margin;
+                Occluder occluder = { disk.x, disk.y, r * r, top(disk), refs[i] };
+                forCells(disk, [&](int c) {
+                    if (occluder.top > cells[c].cover) occluders[counts[c].fetch_add(1, std::memory_order_relaxed)] = occluder;
+                });
+            }
+        });
+        pool.run(ny, [&](int CY, int) {	// by top with ties in store order, so the order of the scatter does not matter
+            for (int CX = 0; CX < nx; CX++) {
+                const Cell& cell = cells[CY * nx + CX];
+                std::sort(occluders.begin() + cell.first, occluders.begin() + cell.first + cell.count, [](const Occluder& a, const Occluder& b) {
+                    return a.top > b.top || (a.top == b.top && (a.ref.kind < b.ref.kind || (a.ref.kind == b.ref.kind && a.ref.index < b.ref.index)));
+                });
+            }
+        });
+    }
+
+    bool occluded(const Primitives& primitives, const Ray& ray, RenderStats& stats) const {	// ray towards the light
+        float x = dot(ray.start, u), y = dot(ray.start, v);
+        if (!(x >= x0 && y >= y0 && x < x0 + nx * cellSize && y < y0 + ny * cellSize)) return false;	// beside the scene
+        const Cell& cell = cells[std::min((int)((y - y0) / cellSize), ny - 1) * nx + std::min((int)((x - x0) / cellSize), nx - 1)];
+        float depth = dot(ray.start, direction);
+        if (depth < cell.cover) return true;
+        for (const Occluder * o = occluders.data() + cell.first, * end = o + cell.count; o != end && o->top > depth; o++) {
+            if ((x - o->x) * (x - o->x) + (y - o->y) * (y - o->y) > o->radius2) continue;	// the ray passes beside
+            stats.intersectionTests++;
+            bool hit = false;
+            primitives.visit(o->ref, [&](const auto& primitive) { hit = primitive.occluded(ray); });
+            if (hit) return true;
+        }
+        return false;
+    }
+};
+
+enum Accelerator { LINEAR_SCAN, BVH_TREE, SIMD_SCAN, SCREEN_BINS, WIDE_BVH, nAccelerators };
+static const char * const acceleratorNames[nAccelerators] = { "linear", "BVH", "SIMD", "bins", "BVH4" };
+
+// Irradiance cache (Ward et al., A Ray Tracing Solution for Diffuse Interreflection) of the diffuse light
+// arriving at rough surfaces. A record keeps the mean incoming radiance E / pi of a cosine weighted
+// hemisphere of rays at its position, the rotational and translational gradients of that mean (Ward and
+// Heckbert, Irradiance Gradients) and the harmonic mean distance R of the hemisphere hits. A point p of
+// normal n takes the records of error |p - pi| / Ri + sqrt(1 - n . ni) below accuracy, each extrapolated
+// along its gradients and weighted by 1 / error - 1 / accuracy, so a record fades out at its border.
+// The records are kept in an octree: a record is stored in the deepest node at least as large as its
+// radius of validity accuracy * R, so the records reaching p are in the nodes whose doubled cube holds p.
+class IrradianceCache {
+public:
+    struct Record {
+        vec3 position, normal;
+        vec3 irradiance;				// mean incoming radiance, E / pi per channel
+        vec3 rotational[3], translational[3];	// gradients of the channels
+        float radius;					// R, clamped
+    };
+    static const int thetaStrata = 8, phiStrata = 24;	// of the hemisphere of a record, phiStrata ~ pi * thetaStrata
+    float accuracy = 0.5f;			// a of Ward, the extrapolation error accepted
+    float minSpacing = 3, maxSpacing = 64;	// accuracy * R in pixels at the distance of the record
+private:
+    struct Node {
+        vec3 center;
+        float halfSize;
+        int children[8];
+        std::vector<int> records;
+    };
+    static const int maxLevels = 24;
+    std::vector<Node> nodes;
+    std::vector<Record> records;
+
+    int addNode(const vec3& center, float halfSize) {
+        Node node;
+        node.center = center;
+        node.halfSize = halfSize;
+        std::fill(node.children, node.children + 8, -1);
+        nodes.push_back(node);
+        return (int)nodes.size() - 1;
+    }
+    static vec3 planeDirection(const vec3& tangent, const vec3& bitangent, float phi) { return tangent * cosf(phi) + bitangent * sinf(phi); }
+public:
+    void clear(const AABB& box) {	// the records will be inside box
+        nodes.clear();
+        records.clear();
+        if (box.bmax.x < box.bmin.x) return;
+        vec3 d = box.bmax - box.bmin;
+        addNode(box.center(), std::max(d.x, std::max(d.y, d.z)) * 0.5f * 1.01f + epsilon);
+    }
+    size_t size() const { return records.size(); }
+
+    // Direction of sample (j, k) of a record, jitter is its position in the stratum. sin^2 theta is uniform in
+    // the strata of theta, so the samples are cosine distributed.
+    static vec3 direction(const vec3& normal, int j, int k, vec2 jitter) {
+        vec3 tangent, bitangent;
+        tangentFrame(normal, tangent, bitangent);
+        float sinTheta = sqrtf((j + jitter.x) / thetaStrata), cosTheta = sqrtf(std::max(0.0f, 1 - sinTheta * sinTheta));
+        return planeDirection(tangent, bitangent, 2 * (float)M_PI * (k + jitter.y) / phiStrata) * sinTheta + normal * cosTheta;
+    }
+
+    // Record of the hemisphere samples (j, k) at j * phiStrata + k, taken in direction(normal, j, k, jitter):
+    // the radiance and the distance of the first hit, FLT_MAX for misses. footprint is the size of a pixel
+    // at the record, R is clamped to [minSpacing, maxSpacing] pixels of validity radius.
+    Record record(const vec3& position, const vec3& normal, const vec3 * radiance, const float * distance, const vec2 * jitter, float footprint) const {
+        const int M = thetaStrata, N = phiStrata;
+        const float pi = (float)M_PI;
+        vec3 tangent, bitangent;
+        tangentFrame(normal, tangent, bitangent);
+        Record r;
+        r.position = position;
+        r.normal = normal;
+        float inverseDistances = 0;
+        for (int s = 0; s < M * N; s++) {
+            r.irradiance = r.irradiance + radiance[s];
+            inverseDistances += 1 / distance[s];
+        }
+        r.irradiance = r.irradiance * (1.0f / (M * N));
+        for (int c = 0; c < 3; c++) r.rotational[c] = r.translational[c] = vec3();
+        for (int k = 0; k < N; k++) {
+            vec3 u = planeDirection(tangent, bitangent, 2 * pi * (k + 0.5f) / N);	// middle of stratum k
+            vec3 v = planeDirection(tangent, bitangent, 2 * pi * k / N + pi / 2);	// normal of its border with stratum k - 1
+            for (int j = 0; j < M; j++) {
+                int s = j * N + k, previousJ = s - N, previousK = j * N + (k + N - 1) % N;
+                // turning the normal weights a sample by (n x d) / cos theta, which is tan theta across its plane
+                float sin2 = (j + jitter[s].x) / M, tanTheta = sqrtf(sin2 / std::max(1 - sin2, 1e-6f));
+                vec3 rotation = planeDirection(tangent, bitangent, 2 * pi * (k + jitter[s].y) / N + pi / 2) * (tanTheta / (M * N));
+                // the borders of the strata move with the position by the distance of the nearer hit, sweeping
+                // the difference of the neighbouring samples over the projected solid angle of the border:
+                // integral of cos theta d theta across phi borders, sin theta cos^2 theta 2 pi / N across theta ones
+                vec3 across = v * ((sqrtf((float)(j + 1) / M) - sqrtf((float)j / M)) / (std::min(distance[s], distance[previousK]) * pi));
+                vec3 outward;
+                if (j > 0) outward = u * (2 / (float)N * sqrtf((float)j / M) * (1.0f - (float)j / M) / std::min(distance[s], distance[previousJ]));
+                for (int c = 0; c < 3; c++) {
+                    float L = axis(radiance[s], c);
+                    r.rotational[c] = r.rotational[c] + rotation * L;
+                    r.translational[c] = r.translational[c] + across * (L - axis(radiance[previousK], c));
+                    if (j > 0) r.translational[c] = r.translational[c] + outward * (L - axis(radiance[previousJ], c));
+                }
+            }
+        }
+        // R: harmonic mean distance, at most where the translational gradient would extrapolate to zero
+        float R = (inverseDistances > 0) ? M * N / inverseDistances : FLT_MAX;
+        for (int c = 0; c < 3; c++) {
+            float g = length(r.translational[c]);
+            if (g > 0) R = std::min(R, axis(r.irradiance, c) / g);
+        }
+        float rMin = minSpacing * footprint / accuracy, rMax = maxSpacing * footprint / accuracy;
+        if (R < rMin)	// the gradient of a clamped record is scaled down, it reaches farther than measured
+            for (int c = 0; c < 3; c++) r.translational[c] = r.translational[c] * (R / rMin);
+        r.radius = std::min(std::max(R, rMin), rMax);
+        return r;
+    }
+
+    void insert(const Record& record) {
+        if (nodes.empty()) return;
+        float validity = accuracy * record.radius;
+        int node = 0;
+        for (int level = 0; level < maxLevels && nodes[node].halfSize * 0.5f >= validity; level++) {
+            vec3 d = record.position - nodes[node].center;
+            float h = nodes[node].halfSize;
+            if (fabsf(d.x) > h || fabsf(d.y) > h || fabsf(d.z) > h) {
+                if (node == 0) return;	// outside of the box of clear
+                break;
+            }
+            int octant = (d.x > 0) | (d.y > 0) << 1 | (d.z > 0) << 2;
+            if (nodes[node].children[octant] < 0) {
+                vec3 center = nodes[node].center + vec3((octant & 1) ? h : -h, (octant & 2) ? h : -h, (octant & 4) ? h : -h) * 0.5f;
+                int child = addNode(center, h * 0.5f);	// may move the nodes
+                nodes[node].children[octant] = child;
+            }
+            node = nodes[node].children[octant];
+        }
+        nodes[node].records.push_back((int)records.size());
+        records.push_back(record);
+    }
+
+    // Interpolated mean incoming radiance at position p of normal n, false if no record is valid there
+    bool lookup(const vec3& p, const vec3& n, vec3& result) const {
+        if (nodes.empty()) return false;
+        int stack[maxLevels * 7 + 8], sp = 0;
+        stack[sp++] = 0;
+        vec3 sum;
+        float weightSum = 0;
+        while (sp > 0) {
+            const Node& node = nodes[stack[--sp]];
+            vec3 d = p - node.center;
+            float reach = 2 * node.halfSize;
+            if (fabsf(d.x) > reach || fabsf(d.y) > reach || fabsf(d.z) > reach) continue;
+            for (int i : node.records) {
+                const Record& r = records[i];
+                vec3 offset = p - r.position;
+                float distance2 = dot(offset, offset), cosine = dot(n, r.normal), validity = accuracy * r.radius;
+                if (distance2 >= validity * validity || cosine <= 0) continue;	// most records are rejected without roots
+                float error = sqrtf(distance2) / r.radius + sqrtf(std::max(0.0f, 1 - cosine));
+                if (error >= accuracy) continue;
+                if (dot(offset, n + r.normal) < -0.1f * r.radius) continue;	// the record is in front of p
+                float w = 1 / std::max(error, 1e-4f) - 1 / accuracy;
+                vec3 rotation = cross(r.normal, n), value;
+                for (int c = 0; c < 3; c++) axis(value, c) = axis(r.irradiance, c) + dot(rotation, r.rotational[c]) + dot(offset, r.translational[c]);
+                sum = sum + value * w;
+                weightSum += w;
+            }
+            for (int child : node.children) if (child >= 0) stack[sp++] = child;
+        }
+        if (weightSum <= 0) return false;
+        result = sum * (1 / weightSum);
+        result = vec3(std::max(result.x, 0.0f), std::max(result.y, 0.0f), std::max(result.z, 0.0f));
+        return true;
+    }
+};
+
+// Queues of the wavefront path tracer (Scene::traceWavefront) in structure of arrays layout: every stage
+// streams through the few arrays it needs, and the rays are kept as float arrays of their components.
+struct RayQueue {
+    std::vector<float> ox, oy, oz, dx, dy, dz;
+
+    void push(const Ray& ray) {
+        ox.push_back(ray.start.x); oy.push_back(ray.start.y); oz.push_back(ray.start.z);
+        dx.push_back(ray.dir.x); dy.push_back(ray.dir.y); dz.push_back(ray.dir.z);
+    }
+    void set(int i, const Ray& ray) {
+        ox[i] = ray.start.x; oy[i] = ray.start.y; oz[i] = ray.start.z;
+        dx[i] = ray.dir.x; dy[i] = ray.dir.y; dz[i] = ray.dir.z;
+    }
+    Ray get(int i) const {	// the direction is normalized already
+        Ray ray;
+        ray.start = vec3(ox[i], oy[i], oz[i]);
+        ray.dir = vec3(dx[i], dy[i], dz[i]);
+        return ray;
+    }
+    void move(int from, int to) { set(to, get(from)); }
+    void resize(size_t n) {
+        for (std::vector<float> * v : { &ox, &oy, &oz, &dx, &dy, &dz }) v->resize(n);
+    }
+};
+
+struct PathQueue {		// the live paths of a wave and the hits of their last rays
+    RayQueue rays;
+    std::vector<int> ids;				// of the path in the wave, indexes the results
+    std::vector<int> X, Y;				// pixel of the camera ray
+    std::vector<Sampler> samplers;
+    std::vector<vec3> throughput, radiance;
+    std::vector<float> t;				// negative where the ray missed
+    std::vector<vec3> positions, normals;
+    std::vector<Material *> materials;
+    std::vector<char> front, alive;
+    std::vector<vec3> weights, direct;	// throughput at a rough hit and the light of its unblocked shadow rays
+    std::vector<char> cached;			// the path may take its diffuse bounce from the irradiance cache
+    std::vector<vec3> indirect;			// light of the bounce taken from the cache at the hit, ending the path
+    std::vector<int> order;				// hits sorted by material
+
+    int size() const { return (int)ids.size(); }
+    void clear() { truncate(0); }
+    void push(const Ray& ray, const Sampler& sampler, int id, int PX, int PY, bool cache = false) {
+        rays.push(ray);
+        ids.push_back(id);
+        X.push_back(PX);
+        Y.push_back(PY);
+        samplers.push_back(sampler);
+        throughput.push_back(vec3(1, 1, 1));
+        radiance.push_back(vec3());
+        t.push_back(-1);
+        positions.push_back(vec3());
+        normals.push_back(vec3());
+        materials.push_back(nullptr);
+        front.push_back(1);
+        alive.push_back(1);
+        weights.push_back(vec3());
+        direct.push_back(vec3());
+        cached.push_back(cache);
+        indirect.push_back(vec3());
+    }
+    void setHit(int i, const Hit& hit) {
+        t[i] = hit.t;
+        materials[i] = hit.material;
+        positions[i] = hit.position;
+        normals[i] = hit.normal;
+        front[i] = hit.front;
+    }
+    Hit hit(int i) const {
+        Hit hit;
+        hit.t = t[i];
+        hit.position = positions[i];
+        hit.normal = normals[i];
+        hit.material = materials[i];
+        hit.front = front[i] != 0;
+        return hit;
+    }
+    void move(int from, int to) {	// the state of path from overwrites path to, the hit is not kept
+        rays.move(from, to);
+        ids[to] = ids[from];
+        X[to] = X[from];
+        Y[to] = Y[from];
+        samplers[to] = samplers[from];
+        throughput[to] = throughput[from];
+        radiance[to] = radiance[from];
+        cached[to] = cached[from];
+    }
+    void truncate(int n) {
+        rays.resize(n);
+        ids.resize(n); X.resize(n); Y.resize(n);
+        t.resize(n);
+        samplers.erase(samplers.begin() + n, samplers.end());	// Sampler has no default constructor
+        for (std::vector<vec3> * v : { &throughput, &radiance, &positions, &normals, &weights, &direct, &indirect }) v->resize(n);
+        materials.resize(n);
+        front.resize(n);
+        alive.resize(n);
+        cached.resize(n);
+    }
+};
+
+struct ShadowQueue {	// shadow rays of the rough hits of a wave towards the lights
+    RayQueue rays;
+    std::vector<int> paths, lights;
+    std::vector<vec3> diffuse, specular;	// reflected light if the ray is not blocked
+
+    int size() const { return (int)paths.size(); }
+    void clear() {
+        rays.resize(0);
+        paths.clear(); lights.clear();
+        diffuse.clear(); specular.clear();
+    }
+    void push(const Ray& ray, int path, int light, const vec3& diffuseLight, const vec3& specularLight) {
+        rays.push(ray);
+        paths.push_back(path);
+        lights.push_back(light);
+        diffuse.push_back(diffuseLight);
+        specular.push_back(specularLight);
+    }
+};
+
+struct WavefrontQueues {
+    static const int waveSize = 4096;	// paths traced together, the queues of a thread stay in its caches
+    PathQueue paths;
+    ShadowQueue shadows;
+    // results of the paths of the wave by id
+    std::vector<vec3> results;
+    std::vector<uint64_t> works;		// intersection tests and BVH nodes of the path
+    std::vector<vec3> primaryNormals;	// of the primary hits for the denoiser features
+    std::vector<float> primaryDepths;	// negative if the camera ray missed
+
+    void start(int nPaths) {
+        paths.clear();
+        shadows.clear();
+        results.assign(nPaths, vec3());
+        works.assign(nPaths, 0);
+        primaryNormals.assign(nPaths, vec3());
+        primaryDepths.assign(nPaths, -1.0f);
+    }
+};
+
+class Scene {
+    friend class SceneFile;		// binary scene files, sceneio.h
+    Arena arena;				// owns the materials, lights, meshes and models
+    Primitives primitives;
+    std::vector<Material *> materials;
+    std::vector<Light *> lights;
+    std::vector<Mesh *> meshes;
+    std::vector<Model *> models;
+    std::vector<std::shared_ptr<const void>> mappings;	// files the meshes and the BVH of a loaded scene point into
+    Camera camera;
+    vec3 La;
+    BVH bvh;
+    WideBVH wideBvh;		// collapsed from bvh for WIDE_BVH
+    int wideBuild = -1;		// buildCount wideBvh was collapsed for
+    SphereSoA spheres;
+    ScreenBins bins;		// of the primary rays of the last frame rendered with SCREEN_BINS
+    std::vector<ShadowGrid> lightGrids;	// of the lights, for shadowGrids
+    int lightGridsBuild = -1;			// buildCount the grids were built for
+    struct IrradianceView {	// what the records of irradiance were made for
+        int buildCount = -1, width = 0, height = 0;
+        vec3 eye, lookat;
+        float fov = 0, accuracy = 0;
+        bool operator==(const IrradianceView& o) const {
+            return buildCount == o.buildCount && width == o.width && height == o.height && eye.x == o.eye.x && eye.y == o.eye.y && eye.z == o.eye.z &&
+                   lookat.x == o.lookat.x && lookat.y == o.lookat.y && lookat.z == o.lookat.z && fov == o.fov && accuracy == o.accuracy;
+        }
+    } irradianceView;
+    int buildCount = 0;
+    std::vector<vec3> velocities;	// of the primitives moved by animate, in the order of forEach
+    struct WorkerStats {	// padded to a cache line, workers merge into their own slot only
+        RenderStats stats;
+        char padding[64 - sizeof(RenderStats) % 64];
+    };
+    std::vector<WorkerStats> workerStats;
+
+    static vec3 bounce(const vec3& position, vec3& velocity, float dt) {	// next position inside the cube of build
+        vec3 next = position + velocity * dt;
+        for (int a = 0; a < 3; a++)
+            if (fabsf(axis(next, a)) > 0.5f && axis(next, a) * axis(velocity, a) > 0) axis(velocity, a) = -axis(velocity, a);
+        return next;
+    }
+    void move(Sphere& sphere, PrimitiveRef ref, vec3& velocity, float dt) {
+        sphere.center = bounce(sphere.center, velocity, dt);
+        spheres.move(ref.index, sphere.center);	// the spheres of build are added to both in the same order
+    }
+    void move(Triangle&, PrimitiveRef, vec3&, float) { }	// meshes are static
+    void move(Instance& instance, PrimitiveRef, vec3& velocity, float dt) {
+        mat4 transform = instance.toWorld;
+        vec3 position = bounce(vec3(transform[3].x, transform[3].y, transform[3].z), velocity, dt);
+        transform[3] = vec4(position.x, position.y, position.z, 1);
+        instance.setTransform(transform);
+    }
+
+    void surface(const Ray& ray, Hit& hit) {	// attributes of the closest hit, the normal faces the ray
+        if (hit.t < 0) return;
+        primitives.visit(hit.primitive, [&](const auto& primitive) { primitive.surface(ray, hit); });
+        hit.front = dot(ray.dir, hit.normal) <= 0;
+        if (!hit.front) hit.normal = hit.normal * (-1);
+    }
+public:
+    Accelerator accelerator = BVH_TREE;	// LINEAR_SCAN is kept to measure the speedup
+    // SCREEN_BINS: primary rays from the screen bins of the frame, the other rays as SIMD_SCAN, no BVH is used
+    // WIDE_BVH: the BVH collapsed to four children per node for single rays, the instances keep their binary BVH
+    bool usePackets = true;	// trace primary rays in screen tiles sharing the culling work
+    int nThreads = 0;		// render threads, 0: one per hardware thread
+    ThreadPool * pool = nullptr;
+    static const int tileSize = 32;	// image tiles handed out to the render threads
+    int width = windowWidth, height = windowHeight;
+    int samplesPerPixel = 1;
+    bool adaptiveSampling = false;	// minSamples per pixel, samplesPerPixel where the contrast exceeds contrastThreshold
+    int minSamples = 4;
+    float contrastThreshold = 0.1f;
+    bool pathTracing = false;	// Monte Carlo path tracing instead of the ambient + direct light model
+    bool wavefront = false;		// path tracing in waves of paths going through the stages together, see traceWavefront
+    SamplerType samplerType = SOBOL_SAMPLER;
+    unsigned int seed = 0;		// of the per-pixel sample sequences
+    int maxPathLength = 5;		// rays per path including the primary ray
+    int maxDepth = 5;			// reflection / refraction levels of trace
+    int rayBudget = 16;			// secondary rays of trace per primary ray, at most maxRayBudget
+    static const int maxRayBudget = 64;
+    float rouletteThreshold = 0.1f;	// paths of lower throughput are continued with probability throughput / threshold
+    float smoothRatio = 0;		// part of the spheres built of gold or glass instead of the rough material
+    float rebuildThreshold = 1.25f;	// update rebuilds the BVH subtrees whose SAH cost grew by this factor
+    bool shadowGrids = false;	// answer the shadow rays from a ShadowGrid of each light instead of the accelerator
+    bool irradianceCaching = false;	// path tracing takes the light of the first diffuse bounce from irradiance
+    IrradianceCache irradiance;	// made by renderTiles for the camera and the scene, see buildIrradianceCache
+    bool timeStages = false;	// time ray generation, traversal and shading, reads the clock for every primary ray
+    bool recordCosts = false;	// keep the work (intersection tests + BVH nodes) spent on each pixel in costs
+    std::vector<float> costs;	// width * height, row 0 at the bottom like the image
+    bool recordFeatures = false;	// keep the mean normal and distance of the primary hits for the denoiser
+    std::vector<vec3> normals;	// width * height, zero where the rays missed
+    std::vector<float> depths;
+
+    ~Scene() { delete pool; }
+
+    ThreadPool& threadPool() {	// created on first use with nThreads threads
+        if (!pool) pool = new ThreadPool(nThreads);
+        return *pool;
+    }
+
+    void setThreads(int _nThreads) {	// the pool is recreated by the next render
+        delete pool;
+        pool = nullptr;
+        nThreads = _nThreads;
+    }
+
+    // counters of the renders since the last resetStats
+    RenderStats stats() const {
+        RenderStats total;
+        for (const WorkerStats& w : workerStats) total += w.stats;
+        return total;
+    }
+    void resetStats() { workerStats.clear(); }
+
+    void setResolution(int _width, int _height) {
+        width = _width;
+        height = _height;
+        camera.setResolution(width, height);
+    }
+
+    // Entity of the scene, e.g. a mesh for addMesh, freed by clear or with the scene.
+    template <class T, class... Args> T * make(Args&&... args) { return arena.make<T>(std::forward<Args>(args)...); }
+
+    // Removes everything built, loaded or added; the memory of the entities is kept for the next build.
+    void clear() {
+        primitives.clear();
+        materials.clear();
+        lights.clear();
+        meshes.clear();
+        models.clear();
+        arena.clear();
+        mappings.clear();
+        spheres.clear();
+        velocities.clear();
+        bvh.build(primitives);
+        buildCount++;
+    }
+
+    void build(int nSpheres = 100) {	// replaces the current content
+        clear();
+        vec3 eye = vec3(0, 0, 2), vup = vec3(0, 1, 0), lookat = vec3(0, 0, 0);
+        float fov = 45 * M_PI / 180;
+        camera.set(eye, lookat, vup, fov);
+
+        La = vec3(0.4f, 0.4f, 0.4f);
+        vec3 lightDirection(1, 1, 1), Le(2, 2, 2);
+        lights.push_back(make<Light>(lightDirection, Le));
+
+        vec3 kd(0.3f, 0.2f, 0.1f), ks(2, 2, 2);
+        Material * material = make<Material>(kd, ks, 50);
+        Material * gold = make<ReflectiveMaterial>(vec3(0.17f, 0.35f, 1.5f), vec3(3.1f, 2.7f, 1.9f));
+        Material * glass = make<RefractiveMaterial>(1.5f);
+        materials.push_back(material);
+        materials.push_back(gold);
+        materials.push_back(glass);
+        int nRough = nSpheres - (int)(nSpheres * smoothRatio);	// the last spheres are smooth, the layout does not change
+        for (int i = 0; i < nSpheres; i++) {
+            vec3 center(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f);
+            float radius = rnd() * 0.1f;
+            Material * sphereMaterial = (i < nRough) ? material : (i % 2 == 0) ? gold : glass;
+            spheres.add(center, radius, primitives.add(Sphere(center, radius, sphereMaterial)));
+        }
+        commit();
+    }
+
+    // Adds the triangles of mesh, made by make<Mesh>, to the scene or to model. Call after build, the
+    // mesh gets the rough material of build if it has none.
+    void addMesh(Mesh * mesh, Model * model = nullptr) {
+        if (!mesh->material && !materials.empty()) mesh->material = materials[0];
+        meshes.push_back(mesh);
+        for (uint32_t face = 0; face < (uint32_t)mesh->faceCount(); face++) {
+            if (model) model->add(Triangle(mesh, face));
+            else primitives.add(Triangle(mesh, face));
+        }
+    }
+
+    Model * addModel() {	// empty model owned by the scene, filled by Model::add or addMesh
+        models.push_back(make<Model>());
+        return models.back();
+    }
+
+    Model * addSphereCluster(int nSpheres) {	// random spheres like the ones of build, call after build
+        Model * model = addModel();
+        int nRough = nSpheres - (int)(nSpheres * smoothRatio);
+        for (int i = 0; i < nSpheres; i++) {
+            vec3 center(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f);
+            float radius = rnd() * 0.1f;
+            model->add(Sphere(center, radius, (i < nRough) ? materials[0] : (i % 2 == 0) ? materials[1] : materials[2]));
+        }
+        return model;
+    }
+
+    // count more directional lights from random directions above the horizon, call after build
+    void addLights(int count) {
+        for (int i = 0; i < count; i++) lights.push_back(make<Light>(vec3(rnd() - 0.5f, 0.1f + rnd(), rnd() - 0.5f), vec3(1, 1, 1)));
+    }
+
+    // Places model into the scene, nothing of its geometry is copied.
+    PrimitiveRef addInstance(const Model * model, const mat4& transform, Material * material = nullptr) {
+        return primitives.add(Instance(model, transform, material));
+    }
+
+    // Moves an instance, only the top-level BVH is rebuilt by the next commit.
+    void setTransform(PrimitiveRef instance, const mat4& transform) {
+        primitives.get<Instance>(instance).setTransform(transform);
+    }
+
+    // count instances at random places of the cube of build, randomly rotated and scaled by 0.5 to 1 times maxScale
+    void scatter(const Model * model, int count, float maxScale) {
+        for (int i = 0; i < count; i++) {
+            vec3 position(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f), rotationAxis(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f);
+            float scale = maxScale * (0.5f + 0.5f * rnd()), angle = rnd() * 2 * M_PI;
+            if (dot(rotationAxis, rotationAxis) < 1e-6f) rotationAxis = vec3(0, 0, 1);
+            addInstance(model, ScaleMatrix(vec3(scale, scale, scale)) * RotationMatrix(angle, rotationAxis) * TranslateMatrix(position));
+        }
+    }
+
+    // Builds the BVH of the models that changed, then the top-level BVH over the primitives and instances
+    // of the scene. Call after primitives were added or instances were moved.
+    void commit() {
+        for (Model * model : models) {
+            if (!model->dirty) continue;
+            model->bvh.build(model->primitives);
+            model->dirty = false;
+        }
+        bvh.build(primitives);
+        buildCount++;
+    }
+
+    // Per-frame alternative of commit after primitives or instances moved, but none were added: the
+    // top-level BVH is refitted in parallel and only its degraded subtrees are rebuilt.
+    // Returns the number of subtrees rebuilt.
+    int update() {
+        for (Model * model : models) {
+            if (!model->dirty) continue;
+            model->bvh.build(model->primitives);
+            model->dirty = false;
+        }
+        buildCount++;	// the primitives moved
+        return bvh.refit(threadPool(), rebuildThreshold);
+    }
+
+    // Moves the spheres and instances of the scene by dt times their random velocity, bouncing off the
+    // walls of the cube of build, and orbits the camera by dt radians. Call update before rendering.
+    void animate(float dt, float speed = 0.2f) {
+        camera.orbit(dt);
+        while (velocities.size() < primitives.size()) velocities.push_back(vec3(rnd() - 0.5f, rnd() - 0.5f, rnd() - 0.5f) * (2 * speed));
+        size_t i = 0;
+        primitives.forEach([&](const auto& primitive, PrimitiveRef ref) { move(primitives.at(ref, &primitive), ref, velocities[i++], dt); });
+    }
+
+    void render(std::vector<vec4>& image) {	// image has width * height pixels, row 0 at the bottom
+        renderTiles(1, [&](int X0, int Y0, int X1, int Y1, const vec4 * pixels) {
+            for (int Y = Y0; Y < Y1; Y++) std::copy(pixels + (Y - Y0) * (X1 - X0), pixels + (Y - Y0 + 1) * (X1 - X0), &image[Y * width + X0]);
+        });
+    }
+
+    // Renders the image tile by tile on the thread pool, tracing one ray per step x step pixel block.
+    // Every finished tile is passed to done(X0, Y0, X1, Y1, pixels) on the thread that rendered it,
+    // the pixels are row major with X1 - X0 per row. Once cancel is set the remaining tiles are skipped.
+    void renderTiles(int step, const std::function<void(int X0, int Y0, int X1, int Y1, const vec4 * pixels)>& done,
+                     const std::atomic<bool> * cancel = nullptr) {
+        threadPool();
+        if ((int)workerStats.size() < pool->size()) workerStats.resize(pool->size());
+        if (recordCosts) costs.resize(width * height);
+        if (recordFeatures) {
+            normals.resize(width * height);
+            depths.resize(width * height);
+        }
+        if (accelerator == SCREEN_BINS) bins.build(primitives, camera, width, height, *pool);
+        if (accelerator == WIDE_BVH && wideBuild != buildCount) {
+            wideBvh.build(bvh, primitives);
+            wideBuild = buildCount;
+        }
+        if (shadowGrids && (lightGridsBuild != buildCount || lightGrids.size() != lights.size())) {
+            lightGrids.resize(lights.size());
+            for (size_t l = 0; l < lights.size(); l++) lightGrids[l].build(primitives, lights[l]->direction, *pool);
+            lightGridsBuild = buildCount;
+        }
+        if (pathTracing && irradianceCaching) buildIrradianceCache(cancel);
+        int nTilesX = (width + tileSize - 1) / tileSize, nTilesY = (height + tileSize - 1) / tileSize;
+        pool->run(nTilesX * nTilesY, [&](int tile, int worker) {
+            if (cancel && *cancel) return;
+            int X0 = (tile % nTilesX) * tileSize, Y0 = (tile / nTilesX) * tileSize;
+            int X1 = std::min(X0 + tileSize, width), Y1 = std::min(Y0 + tileSize, height);
+            vec4 pixels[tileSize * tileSize];	// local buffer, threads do not share cache lines of the image
+            threadStats() = RenderStats();
+            renderTile(pixels, X0, Y0, X1, Y1, step);
+            workerStats[worker].stats += threadStats();
+            done(X0, Y0, X1, Y1, pixels);
+        });
+    }
+
+    // Makes the records of irradiance at the rough camera hits through the pixels of lattices of 32, 16, 8
+    // and 4 pixels spacing, where the records of the coarser lattices are not valid. The records of a
+    // lattice are made in parallel by rows and inserted in pixel order, so the cache does not depend on
+    // the thread count. Kept while the scene, the camera and the resolution stay the same.
+    void buildIrradianceCache(const std::atomic<bool> * cancel = nullptr) {
+        IrradianceView view;
+        vec3 vup;
+        camera.get(view.eye, view.lookat, vup, view.fov);
+        view.buildCount = buildCount;
+        view.width = width;
+        view.height = height;
+        view.accuracy = irradiance.accuracy;
+        if (irradianceView == view) return;
+        AABB box;
+        primitives.forEach([&](const auto& primitive, PrimitiveRef) { box.grow(primitive.bounds()); });
+        irradiance.clear(box);
+        float footprint = 2 * tanf(view.fov / 2) / width;	// pixel size at unit distance
+        for (int spacing = 32; spacing >= 4; spacing /= 2) {
+            int nx = (width + spacing - 1) / spacing, ny = (height + spacing - 1) / spacing;
+            std::vector<std::vector<IrradianceCache::Record>> rows(ny);
+            pool->run(ny, [&](int row, int worker) {
+                threadStats() = RenderStats();
+                for (int col = 0; col < nx; col++) {
+                    int X = std::min(col * spacing + spacing / 2, width - 1), Y = std::min(row * spacing + spacing / 2, height - 1);
+                    Hit hit = primaryIntersect(camera.getRay(X, Y), X, Y);
+                    vec3 covered;
+                    if (hit.t < 0 || !hit.material->rough || irradiance.lookup(hit.position, hit.normal, covered)) continue;
+                    rows[row].push_back(irradianceRecord(hit, X, Y, hit.t * footprint));
+                }
+                workerStats[worker].stats += threadStats();
+            });
+            for (const auto& row : rows)
+                for (const IrradianceCache::Record& record : row) irradiance.insert(record);
+            if (cancel && *cancel) return;	// made again by the next render
+        }
+        irradianceView = view;
+    }
+
+    IrradianceCache::Record irradianceRecord(const Hit& hit, int X, int Y, float footprint) {	// hemisphere of paths at hit
+        const int M = IrradianceCache::thetaStrata, N = IrradianceCache::phiStrata;
+        vec3 radiance[M * N];
+        float distance[M * N];
+        vec2 jitter[M * N];
+        Sampler sampler(samplerType, hashCombine(seed, 1), X, Y, M * N);	// not correlated with the samples of the pixel
+        for (int s = 0; s < M * N; s++) {
+            sampler.startSample(s);
+            jitter[s] = sampler.get2D();
+            Ray ray(hit.position + hit.normal * epsilon, IrradianceCache::direction(hit.normal, s / N, s % N, jitter[s]));
+            Hit first;
+            radiance[s] = tracePath(ray, sampler, &first, -1, -1, 1);
+            distance[s] = (first.t > 0) ? first.t : FLT_MAX;
+        }
+        return irradiance.record(hit.position, hit.normal, radiance, distance, jitter, footprint);
+    }
+
+    void renderTile(vec4 * pixels, int X0, int Y0, int X1, int Y1, int step = 1) {
+        int tileWidth = X1 - X0;
+        RenderStats& stats = threadStats();
+        StageTimer timer(timeStages);
+        bool recordCost = recordCosts && step == 1;
+        bool recordFeature = recordFeatures && step == 1;
+        int featureCount[tileSize * tileSize];	// samples of the normal and depth sums of the pixels
+        if (recordFeature) {
+            std::fill(featureCount, featureCount + tileSize * tileSize, 0);
+            for (int Y = Y0; Y < Y1; Y++) {
+                std::fill(&normals[Y * width + X0], &normals[Y * width + X0] + tileWidth, vec3());
+                std::fill(&depths[Y * width + X0], &depths[Y * width + X0] + tileWidth, 0.0f);
+            }
+        }
+        auto addFeature = [&](int X, int Y, const Hit& hit) {	// misses count with zero normal and depth
+            if (!recordFeature || X < X0 || X >= X1 || Y < Y0 || Y >= Y1) return;	// padding of the adaptive sampling
+            featureCount[(Y - Y0) * tileWidth + X - X0]++;
+            if (hit.t < 0) return;
+            normals[Y * width + X] = normals[Y * width + X] + hit.normal;
+            depths[Y * width + X] += hit.t;
+        };
+        auto tracePrimary = [&](int X, int Y, float dx, float dy) {
+            Ray ray = camera.getRay(X, Y, dx, dy);
+            timer.lap(stats.generationTime);
+            Hit hit = primaryIntersect(ray, X, Y);
+            timer.lap(stats.traversalTime);
+            addFeature(X, Y, hit);
+            vec3 color = shade(ray, hit);
+            timer.lap(stats.shadingTime);
+            return color;
+        };
+        if (step > 1) stats.primaryRays += (uint64_t)((tileWidth + step - 1) / step) * ((Y1 - Y0 + step - 1) / step);
+        else if (!adaptiveSampling || pathTracing) stats.primaryRays += (uint64_t)tileWidth * (Y1 - Y0) * samplesPerPixel;
+        if (pathTracing && wavefront) {	// the paths of the blocks below in waves, a block is done with its last sample
+            static thread_local WavefrontQueues queues;
+            int nSamples = (step > 1) ? 1 : samplesPerPixel;
+            int nBlocksX = (tileWidth + step - 1) / step, nBlocks = nBlocksX * ((Y1 - Y0 + step - 1) / step);
+            vec3 colors[tileSize * tileSize];
+            uint64_t works[tileSize * tileSize];
+            for (int first = 0; first < nBlocks * nSamples; first += WavefrontQueues::waveSize) {
+                int last = std::min(first + WavefrontQueues::waveSize, nBlocks * nSamples);
+                queues.start(last - first);
+                for (int path = first; path < last; path++) {
+                    int block = path / nSamples, X = X0 + block % nBlocksX * step, Y = Y0 + block / nBlocksX * step;
+                    int SX = std::min(X + step / 2, X1 - 1), SY = std::min(Y + step / 2, Y1 - 1);
+                    Sampler sampler(samplerType, seed, SX, SY, nSamples);
+                    sampler.startSample(path % nSamples);
+                    vec2 d = sampler.get2D();
+                    queues.paths.push(camera.getRay(SX, SY, d.x, d.y), sampler, path - first, SX, SY, irradianceCaching);
+                }
+                timer.lap(stats.generationTime);
+                traceWavefront(queues, timer);
+                for (int path = first; path < last; path++) {
+                    int block = path / nSamples, X = X0 + block % nBlocksX * step, Y = Y0 + block / nBlocksX * step;
+                    if (path % nSamples == 0) {
+                        colors[block] = vec3();
+                        works[block] = 0;
+                    }
+                    colors[block] = colors[block] + queues.results[path - first];
+                    works[block] += queues.works[path - first];
+                    Hit hit;
+                    hit.t = queues.primaryDepths[path - first];
+                    hit.normal = queues.primaryNormals[path - first];
+                    addFeature(std::min(X + step / 2, X1 - 1), std::min(Y + step / 2, Y1 - 1), hit);
+                    if (path % nSamples < nSamples - 1) continue;
+                    vec3 color = colors[block] * (1.0f / nSamples);
+                    for (int BY = Y; BY < std::min(Y + step, Y1); BY++)
+                        for (int BX = X; BX < std::min(X + step, X1); BX++) pixels[(BY - Y0) * tileWidth + BX - X0] = vec4(color.x, color.y, color.z, 1);
+                    if (recordCost) costs[Y * width + X] = (float)works[block];
+                }
+                timer.lap(stats.shadingTime);
+            }
+        } else if (pathTracing) {	// a preview block takes the first sample of the pixel in its middle
+            int nSamples = (step > 1) ? 1 : samplesPerPixel;
+            for (int Y = Y0; Y < Y1; Y += step) {
+                for (int X = X0; X < X1; X += step) {
+                    uint64_t work = stats.work();
+                    int SX = std::min(X + step / 2, X1 - 1), SY = std::min(Y + step / 2, Y1 - 1);
+                    Sampler sampler(samplerType, seed, SX, SY, nSamples);
+                    vec3 color;
+                    for (int i = 0; i < nSamples; i++) {
+                        sampler.startSample(i);
+                        vec2 d = sampler.get2D();
+                        Ray ray = camera.getRay(SX, SY, d.x, d.y);
+                        timer.lap(stats.generationTime);
+                        Hit hit;
+                        color = color + tracePath(ray, sampler, &hit, SX, SY);
+                        addFeature(SX, SY, hit);
+                        timer.lap(stats.shadingTime);
+                    }
+                    color = color * (1.0f / nSamples);
+                    for (int BY = Y; BY < std::min(Y + step, Y1); BY++)
+                        for (int BX = X; BX < std::min(X + step, X1); BX++) pixels[(BY - Y0) * tileWidth + BX - X0] = vec4(color.x, color.y, color.z, 1);
+                    if (recordCost) costs[Y * width + X] = (float)(stats.work() - work);
+                }
+            }
+        } else if (step > 1) {	// preview: the ray through the middle of the block colors the whole block
+            for (int Y = Y0; Y < Y1; Y += step) {
+                for (int X = X0; X < X1; X += step) {
+                    vec3 color = tracePrimary(std::min(X + step / 2, X1 - 1), std::min(Y + step / 2, Y1 - 1), 0.5f, 0.5f);
+                    for (int BY = Y; BY < std::min(Y + step, Y1); BY++)
+                        for (int BX = X; BX < std::min(X + step, X1); BX++) pixels[(BY - Y0) * tileWidth + BX - X0] = vec4(color.x, color.y, color.z, 1);
+                }
+            }
+        } else if (adaptiveSampling) {
+            // Mitchell's contrast (max - min) / (max + min) of each channel is taken over the first samples of the
+            // pixel and the mean of its four neighbours. Pixels above the threshold, typically silhouettes and shadow
+            // edges, get the rest of the samplesPerPixel samples. The first samples are also taken on a one pixel
+            // border around the tile, the same ones the neighbouring tile takes, so there is no seam along the tiles.
+            struct PixelSamples {
+                vec3 sum, lo, hi;
+                int count;
+                uint64_t work;
+            };
+            const int paddedSize = tileSize + 2;
+            int PX0 = std::max(X0 - 1, 0), PY0 = std::max(Y0 - 1, 0), PX1 = std::min(X1 + 1, width), PY1 = std::min(Y1 + 1, height);
+            int paddedWidth = PX1 - PX0;
+            PixelSamples samples[paddedSize * paddedSize];
+            int nSamples = std::max(samplesPerPixel, minSamples);
+            auto addSamples = [&](int X, int Y, int to) {
+                PixelSamples& p = samples[(Y - PY0) * paddedWidth + X - PX0];
+                Sampler sampler(samplerType, seed, X, Y, nSamples);
+                uint64_t work = stats.work();
+                for (int i = p.count; i < to; i++) {
+                    sampler.startSample(i);
+                    vec2 d = sampler.get2D();
+                    vec3 color = tracePrimary(X, Y, d.x, d.y);
+                    p.sum = p.sum + color;
+                    p.lo = vec3(std::min(p.lo.x, color.x), std::min(p.lo.y, color.y), std::min(p.lo.z, color.z));
+                    p.hi = vec3(std::max(p.hi.x, color.x), std::max(p.hi.y, color.y), std::max(p.hi.z, color.z));
+                }
+                stats.primaryRays += to - p.count;
+                p.count = to;
+                p.work += stats.work() - work;
+            };
+            for (int Y = PY0; Y < PY1; Y++) {
+                for (int X = PX0; X < PX1; X++) {
+                    samples[(Y - PY0) * paddedWidth + X - PX0] = { vec3(), vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX), 0, 0 };
+                    addSamples(X, Y, std::min(minSamples, nSamples));
+                }
+            }
+            bool refine[tileSize * tileSize];
+            for (int Y = Y0; Y < Y1; Y++) {
+                for (int X = X0; X < X1; X++) {
+                    const PixelSamples& p = samples[(Y - PY0) * paddedWidth + X - PX0];
+                    vec3 lo = p.lo, hi = p.hi;
+                    const int neighbours[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+                    for (const auto& n : neighbours) {
+                        int NX = X + n[0], NY = Y + n[1];
+                        if (NX < PX0 || NX >= PX1 || NY < PY0 || NY >= PY1) continue;	// outside the image
+                        const PixelSamples& q = samples[(NY - PY0) * paddedWidth + NX - PX0];
+                        vec3 mean = q.sum / q.count;
+                        lo = vec3(std::min(lo.x, mean.x), std::min(lo.y, mean.y), std::min(lo.z, mean.z));
+                        hi = vec3(std::max(hi.x, mean.x), std::max(hi.y, mean.y), std::max(hi.z, mean.z));
+                    }
+                    float contrast = 0;
+                    for (int k = 0; k < 3; k++) contrast = std::max(contrast, (axis(hi, k) - axis(lo, k)) / (axis(hi, k) + axis(lo, k) + 1e-4f));
+                    refine[(Y - Y0) * tileWidth + X - X0] = contrast > contrastThreshold;
+                }
+            }
+            for (int Y = Y0; Y < Y1; Y++) {
+                for (int X = X0; X < X1; X++) {
+                    if (refine[(Y - Y0) * tileWidth + X - X0]) addSamples(X, Y, nSamples);
+                    const PixelSamples& p = samples[(Y - PY0) * paddedWidth + X - PX0];
+                    vec3 color = p.sum / p.count;
+                    pixels[(Y - Y0) * tileWidth + X - X0] = vec4(color.x, color.y, color.z, 1);
+                    if (recordCost) costs[Y * width + X] = (float)p.work;
+                }
+            }
+        } else if (samplesPerPixel > 1) {	// the sub-pixel offsets come from the sampler of the pixel
+            for (int Y = Y0; Y < Y1; Y++) {
+                for (int X = X0; X < X1; X++) {
+                    uint64_t work = stats.work();
+                    Sampler sampler(samplerType, seed, X, Y, samplesPerPixel);
+                    vec3 color;
+                    for (int i = 0; i < samplesPerPixel; i++) {
+                        sampler.startSample(i);
+                        vec2 d = sampler.get2D();
+                        color = color + tracePrimary(X, Y, d.x, d.y);
+                    }
+                    color = color * (1.0f / samplesPerPixel);
+                    pixels[(Y - Y0) * tileWidth + X - X0] = vec4(color.x, color.y, color.z, 1);
+                    if (recordCost) costs[Y * width + X] = (float)(stats.work() - work);
+                }
+            }
+        } else if (usePackets) {	// the traversal work of a packet is shared evenly by its rays in the cost map
+            RayPacket packet;
+            for (int PY = Y0; PY < Y1; PY += RayPacket::tileSize) {
+                for (int PX = X0; PX < X1; PX += RayPacket::tileSize) {
+                    uint64_t work = stats.work();
+                    camera.getPacket(PX, PY, packet);
+                    timer.lap(stats.generationTime);
+                    firstIntersect(packet);
+                    timer.lap(stats.traversalTime);
+                    float packetCost = (float)(stats.work() - work) / packet.count;
+                    for (int i = 0; i < packet.count; i++) {
+                        work = stats.work();
+                        addFeature(packet.X[i], packet.Y[i], packet.hits[i]);
+                        vec3 color = shade(packet.rays[i], packet.hits[i]);
+                        pixels[(packet.Y[i] - Y0) * tileWidth + packet.X[i] - X0] = vec4(color.x, color.y, color.z, 1);
+                        if (recordCost) costs[packet.Y[i] * width + packet.X[i]] = packetCost + (float)(stats.work() - work);
+                    }
+                    timer.lap(stats.shadingTime);
+                }
+            }
+        } else {
+            for (int Y = Y0; Y < Y1; Y++) {
+                for (int X = X0; X < X1; X++) {
+                    uint64_t work = stats.work();
+                    vec3 color = tracePrimary(X, Y, 0.5f, 0.5f);
+                    pixels[(Y - Y0) * tileWidth + X - X0] = vec4(color.x, color.y, color.z, 1);
+                    if (recordCost) costs[Y * width + X] = (float)(stats.work() - work);
+                }
+            }
+        }
+        if (recordFeature) {
+            for (int Y = Y0; Y < Y1; Y++) {
+                for (int X = X0; X < X1; X++) {
+                    int count = featureCount[(Y - Y0) * tileWidth + X - X0];
+                    if (count <= 1) continue;
+                    normals[Y * width + X] = normals[Y * width + X] / (float)count;
+                    depths[Y * width + X] /= count;
+                }
+            }
+        }
+    }
+
+    void firstIntersect(RayPacket& packet) {
+        switch (accelerator) {
+        case BVH_TREE: bvh.firstIntersect(packet); break;
+        case LINEAR_SCAN:
+            primitives.forEach([&](const auto& primitive, PrimitiveRef ref) {
+                if (packet.frustumMisses(primitive.bounds())) return;
+                threadStats().intersectionTests += packet.count;
+                for (int r = 0; r < packet.count; r++) {
+                    float t = primitive.intersect(packet.rays[r], packet.tMax(r));
+                    Hit& bestHit = packet.hits[r];
+                    if (t > 0 && (bestHit.t < 0 || t < bestHit.t)) { bestHit.t = t; bestHit.primitive = ref; }
+                }
+            });
+            break;
+        case SCREEN_BINS: {	// the packet tiles are the bins
+            const PrimitiveRef * begin, * end;
+            bins.get(packet.X[0], packet.Y[0], begin, end);
+            threadStats().intersectionTests += (end - begin) * packet.count;
+            for (const PrimitiveRef * ref = begin; ref != end; ref++) {
+                primitives.visit(*ref, [&](const auto& primitive) {
+                    for (int r = 0; r < packet.count; r++) {
+                        float t = primitive.intersect(packet.rays[r], packet.tMax(r));
+                        Hit& bestHit = packet.hits[r];
+                        if (t > 0 && (bestHit.t < 0 || t < bestHit.t)) { bestHit.t = t; bestHit.primitive = *ref; }
+                    }
+                });
+            }
+            break;
+        }
+        default:
+            for (int r = 0; r < packet.count; r++) packet.hits[r] = firstIntersect(packet.rays[r]);
+            return;
+        }
+        for (int r = 0; r < packet.count; r++) surface(packet.rays[r], packet.hits[r]);
+    }
+
+    Hit primaryIntersect(const Ray& ray, int X, int Y) {	// closest hit of a camera ray through pixel (X, Y)
+        if (accelerator != SCREEN_BINS || X < 0) return firstIntersect(ray);
+        Hit bestHit;
+        const PrimitiveRef * begin, * end;
+        bins.get(X, Y, begin, end);
+        threadStats().intersectionTests += end - begin;
+        for (const PrimitiveRef * ref = begin; ref != end; ref++) {
+            primitives.visit(*ref, [&](const auto& primitive) {
+                float t = primitive.intersect(ray, (bestHit.t > 0) ? bestHit.t : FLT_MAX);
+                if (t > 0 && (bestHit.t < 0 || t < bestHit.t)) { bestHit.t = t; bestHit.primitive = *ref; }
+            });
+        }
+        surface(ray, bestHit);
+        return bestHit;
+    }
+
+    Hit firstIntersect(Ray ray) {
+        Hit bestHit;
+        switch (accelerator) {
+        case BVH_TREE: bestHit = bvh.firstIntersect(ray); break;
+        case WIDE_BVH: bestHit = wideBvh.firstIntersect(ray); break;
+        case SIMD_SCAN:
+        case SCREEN_BINS: {
+            float t;
+            int i = spheres.firstIntersect(ray, t);
+            if (i >= 0) { bestHit.t = t; bestHit.primitive = spheres.ref(i); }
+            firstIntersect(ray, bestHit, 1);	// the other kinds one by one
+            break;
+        }
+        default: firstIntersect(ray, bestHit, 0);
+        }
+        surface(ray, bestHit);
+        return bestHit;
+    }
+
+    void firstIntersect(const Ray& ray, Hit& bestHit, int firstKind) {	// linear scan of the kinds from firstKind on
+        threadStats().intersectionTests += primitives.size(firstKind);
+        primitives.forEach([&](const auto& primitive, PrimitiveRef ref) {
+            float t = primitive.intersect(ray, (bestHit.t > 0) ? bestHit.t : FLT_MAX); //  t < 0 if no intersection
+            if (t > 0 && (bestHit.t < 0 || t < bestHit.t)) { bestHit.t = t; bestHit.primitive = ref; }
+        }, firstKind);
+    }
+
+    // Neighbouring shadow rays are usually blocked by the same object, so the last occluder found by the
+    // thread is tested first. The hint is tagged with the scene and its build so it never outlives them.
+    struct OcclusionHint {
+        const Scene * scene = nullptr;
+        int buildCount = 0;
+        PrimitiveRef object;
+        int sphere = -1;
+    };
+
+    bool shadowIntersect(Ray ray, int light) {	// towards lights[light], a directional light
+        static thread_local OcclusionHint hint;
+        RenderStats& stats = threadStats();
+        stats.shadowRays++;
+        if (shadowGrids && lightGridsBuild == buildCount && light < (int)lightGrids.size())
+            return lightGrids[light].occluded(primitives, ray, stats);
+        if (hint.scene != this || hint.buildCount != buildCount) {
+            hint = OcclusionHint();
+            hint.scene = this;
+            hint.buildCount = buildCount;
+        }
+        bool sphereKernel = accelerator == SIMD_SCAN || accelerator == SCREEN_BINS;
+        if (sphereKernel) {
+            if (hint.sphere >= 0) {
+                stats.intersectionTests++;
+                if (spheres.occluded(ray, hint.sphere)) return true;
+            }
+            hint.sphere = spheres.anyIntersect(ray);
+            if (hint.sphere >= 0) return true;
+        }
+        if (hint.object.valid()) {
+            stats.intersectionTests++;
+            bool occluded = false;
+            primitives.visit(hint.object, [&](const auto& primitive) { occluded = primitive.occluded(ray); });
+            if (occluded) return true;
+        }
+        if (accelerator == BVH_TREE) hint.object = bvh.anyIntersect(ray);
+        else if (accelerator == WIDE_BVH) hint.object = wideBvh.anyIntersect(ray);
+        else {
+            hint.object = PrimitiveRef();
+            primitives.anyOf([&](const auto& primitive, PrimitiveRef ref) {
+                stats.intersectionTests++;
+                if (primitive.occluded(ray)) hint.object = ref;
+                return hint.object.valid();
+            }, sphereKernel ? 1 : 0);	// the spheres were tested by the SIMD kernel
+        }
+        return hint.object.valid();
+    }
+
+    vec3 trace(Ray ray) {
+        return shade(ray, firstIntersect(ray));
+    }
+
+    // Light reflected towards the ray from the lights, without the ambient term. The specular lobe is only
+    // evaluated for the lights, the paths continue in the diffuse directions.
+    vec3 directLight(const Ray& ray, const Hit& hit) {
+        vec3 outRadiance;
+        for (int l = 0; l < (int)lights.size(); l++) {
+            const Light * light = lights[l];
+            Ray shadowRay(hit.position + hit.normal * epsilon, light->direction);
+            float cosTheta = dot(hit.normal, light->direction);
+            if (cosTheta > 0 && !shadowIntersect(shadowRay, l)) {	// shadow computation
+                outRadiance = outRadiance + light->Le * hit.material->kd * cosTheta;
+                vec3 halfway = normalize(-ray.dir + light->direction);
+                float cosDelta = dot(hit.normal, halfway);
+                if (cosDelta > 0) outRadiance = outRadiance + light->Le * hit.material->ks * powf(cosDelta, hit.material->shininess);
+            }
+        }
+        return outRadiance;
+    }
+
+    // Reflected and refracted rays of a smooth surface with their Fresnel weights, count is 0, 1 or 2
+    int scatter(const Ray& ray, const Hit& hit, Ray rays[2], vec3 weights[2]) {
+        const Material * material = hit.material;
+        if (!material->reflective) return 0;
+        float cosTheta = -dot(ray.dir, hit.normal);
+        vec3 reflected = ray.dir + hit.normal * (2 * cosTheta);
+        if (!material->refractive) {
+            rays[0] = Ray(hit.position + hit.normal * epsilon, reflected);
+            weights[0] = Fresnel(material->F0, cosTheta);
+            return 1;
+        }
+        float n = hit.front ? material->ior : 1 / material->ior;	// relative index of the side entered
+        float disc = 1 - (1 - cosTheta * cosTheta) / (n * n);
+        if (disc < 0) {	// total internal reflection
+            rays[0] = Ray(hit.position + hit.normal * epsilon, reflected);
+            weights[0] = vec3(1, 1, 1);
+            return 1;
+        }
+        float cosRefracted = sqrtf(disc);
+        vec3 F = Fresnel(material->F0, hit.front ? cosTheta : cosRefracted);	// the angle on the optically thinner side
+        rays[0] = Ray(hit.position + hit.normal * epsilon, reflected);
+        weights[0] = F;
+        rays[1] = Ray(hit.position - hit.normal * epsilon, ray.dir / n + hit.normal * (cosTheta / n - cosRefracted));
+        weights[1] = vec3(1, 1, 1) - F;
+        return 2;
+    }
+
+    // Russian roulette: a weight below rouletteThreshold survives with probability weight / threshold
+    // and is scaled up to stay unbiased. u is the uniform random number of the decision.
+    bool survives(vec3& weight, float u) {
+        float w = std::max(weight.x, std::max(weight.y, weight.z));
+        if (w >= rouletteThreshold) return true;
+        float p = w / rouletteThreshold;
+        if (u >= p) return false;
+        weight = weight * (1 / p);
+        return true;
+    }
+
+    // Whitted style shading: ambient and direct light on rough surfaces, reflection and refraction on smooth
+    // ones. The secondary rays are traced iteratively from a stack, at most maxDepth levels deep and at most
+    // rayBudget rays for a primary ray. The roulette takes its random numbers from a hash of the ray, so the
+    // image does not depend on the thread count.
+    vec3 shade(const Ray& ray, const Hit& hit) {
+        struct SecondaryRay {
+            Ray ray;
+            vec3 weight;
+            int depth;
+        };
+        SecondaryRay stack[maxRayBudget];
+        int sp = 0, budget = std::min(rayBudget, (int)maxRayBudget);
+        RenderStats& stats = threadStats();
+        vec3 radiance;
+        Ray currentRay = ray;
+        Hit currentHit = hit;
+        vec3 weight(1, 1, 1);
+        int depth = 0;
+        for (;;) {
+            if (currentHit.t < 0) radiance = radiance + weight * La;
+            else {
+                if (currentHit.material->rough) radiance = radiance + weight * (currentHit.material->ka * La + directLight(currentRay, currentHit));
+                Ray rays[2];
+                vec3 weights[2];
+                int count = (depth < maxDepth) ? scatter(currentRay, currentHit, rays, weights) : 0;
+                for (int i = 0; i < count && budget > 0; i++) {
+                    vec3 w = weight * weights[i];
+                    if (!survives(w, rayRandom(rays[i], depth))) continue;
+                    stack[sp++] = { rays[i], w, depth + 1 };
+                    budget--;
+                }
+            }
+            if (sp == 0) return radiance;
+            SecondaryRay next = stack[--sp];
+            stats.secondaryRays++;
+            currentRay = next.ray;
+            weight = next.weight;
+            depth = next.depth;
+            currentHit = firstIntersect(currentRay);
+        }
+    }
+
+    // Path traced radiance: the sky of radiance La is reached through cosine distributed diffuse bounces,
+    // the lights are sampled at every vertex. The diffuse BRDF is kd, so the bounce weight cos / pdf * kd
+    // is ka = kd * pi, which keeps the mean of the image close to the ambient model.
+    // Smooth surfaces continue the path in the reflected or the refracted direction, chosen with the
+    // probability of their Fresnel weights. Dim paths are ended by the roulette.
+    // With irradianceCaching the first rough vertex of a camera path takes the light of its diffuse bounce
+    // from the cache where a record is valid, and the path ends there.
+    // (X, Y) is the pixel of a camera ray, -1 for other rays. firstDepth is the number of vertices before ray,
+    // 1 for the rays of the irradiance records.
+    vec3 tracePath(Ray ray, Sampler& sampler, Hit * primaryHit = nullptr, int X = -1, int Y = -1, int firstDepth = 0) {
+        vec3 radiance, throughput(1, 1, 1);
+        bool cached = irradianceCaching && firstDepth == 0;	// no diffuse bounce yet
+        for (int depth = firstDepth; depth < maxPathLength; depth++) {
+            if (depth > 0) threadStats().secondaryRays++;
+            Hit hit = (depth == 0) ? primaryIntersect(ray, X, Y) : firstIntersect(ray);
+            if (depth == firstDepth && primaryHit) *primaryHit = hit;
+            if (hit.t < 0) return radiance + throughput * La;
+            if (hit.material->rough) {
+                radiance = radiance + throughput * directLight(ray, hit);
+                vec3 indirect;
+                if (cached && irradiance.lookup(hit.position, hit.normal, indirect)) return radiance + throughput * hit.material->ka * indirect;
+                cached = false;
+                ray = Ray(hit.position + hit.normal * epsilon, sampleCosine(hit.normal, sampler.get2D()));
+                throughput = throughput * hit.material->ka;
+            } else {
+                Ray rays[2];
+                vec3 weights[2];
+                int count = scatter(ray, hit, rays, weights);
+                if (count == 0) break;
+                int i = 0;
+                if (count == 2) {
+                    float p = (weights[0].x + weights[0].y + weights[0].z) / 3;
+                    i = (sampler.get1D() < p) ? 0 : 1;
+                    weights[i] = weights[i] * (1 / ((i == 0) ? p : 1 - p));
+                }
+                ray = rays[i];
+                throughput = throughput * weights[i];
+            }
+            if (!survives(throughput, sampler.get1D())) break;
+        }
+        return radiance;
+    }
+
+    // Wavefront form of tracePath (Laine et al., Megakernels Considered Harmful) for the camera rays pushed
+    // to queues.paths. Instead of following one path to its end, every vertex of the paths is taken by a
+    // sequence of stages over the whole wave: the rays are intersected, the misses end their paths, the hits
+    // are sorted by material and shaded, which queues the shadow rays and sets the next ray of the path,
+    // the shadow rays are traced together and the live paths are compacted for the next vertex. Every path
+    // takes the same samples and sums its radiance in the same order as tracePath, so the images match.
+    void traceWavefront(WavefrontQueues& queues, StageTimer& timer) {
+        RenderStats& stats = threadStats();
+        PathQueue& paths = queues.paths;
+        ShadowQueue& shadows = queues.shadows;
+        for (int depth = 0; depth < maxPathLength && paths.size() > 0; depth++) {
+            int n = paths.size();
+            for (int i = 0; i < n; i++) {	// intersection
+                uint64_t work = stats.work();
+                Ray ray = paths.rays.get(i);
+                if (depth > 0) stats.secondaryRays++;
+                Hit hit = (depth == 0) ? primaryIntersect(ray, paths.X[i], paths.Y[i]) : firstIntersect(ray);
+                paths.setHit(i, hit);
+                if (depth == 0) {
+                    queues.primaryDepths[paths.ids[i]] = hit.t;
+                    queues.primaryNormals[paths.ids[i]] = hit.normal;
+                }
+                queues.works[paths.ids[i]] += stats.work() - work;
+            }
+            timer.lap(stats.traversalTime);
+            paths.order.clear();
+            for (int i = 0; i < n; i++) {
+                if (paths.t[i] >= 0) paths.order.push_back(i);
+                else {
+                    paths.radiance[i] = paths.radiance[i] + paths.throughput[i] * La;
+                    paths.alive[i] = 0;
+                }
+            }
+            std::sort(paths.order.begin(), paths.order.end(), [&](int a, int b) {	// the hits of a material together, in path order
+                const Material * ma = paths.materials[a], * mb = paths.materials[b];
+                return (ma != mb) ? std::less<const Material *>()(ma, mb) : a < b;
+            });
+            shadows.clear();
+            for (int i : paths.order) {	// shading
+                Hit hit = paths.hit(i);
+                Ray ray = paths.rays.get(i);
+                vec3& throughput = paths.throughput[i];
+                if (hit.material->rough) {
+                    for (int l = 0; l < (int)lights.size(); l++) {	// as directLight
+                        const Light * light = lights[l];
+                        float cosTheta = dot(hit.normal, light->direction);
+                        if (cosTheta <= 0) continue;
+                        vec3 halfway = normalize(-ray.dir + light->direction), specular;
+                        float cosDelta = dot(hit.normal, halfway);
+                        if (cosDelta > 0) specular = light->Le * hit.material->ks * powf(cosDelta, hit.material->shininess);
+                        shadows.push(Ray(hit.position + hit.normal * epsilon, light->direction), i, l, light->Le * hit.material->kd * cosTheta, specular);
+                    }
+                    paths.weights[i] = throughput;
+                    paths.direct[i] = vec3();
+                    paths.indirect[i] = vec3();
+                    vec3 indirect;
+                    if (paths.cached[i] && irradiance.lookup(hit.position, hit.normal, indirect)) {
+                        paths.indirect[i] = throughput * hit.material->ka * indirect;
+                        paths.alive[i] = 0;
+                        continue;
+                    }
+                    paths.cached[i] = 0;
+                    paths.rays.set(i, Ray(hit.position + hit.normal * epsilon, sampleCosine(hit.normal, paths.samplers[i].get2D())));
+                    throughput = throughput * hit.material->ka;
+                } else {
+                    Ray rays[2];
+                    vec3 weights[2];
+                    int count = scatter(ray, hit, rays, weights);
+                    if (count == 0) {
+                        paths.alive[i] = 0;
+                        continue;
+                    }
+                    int r = 0;
+                    if (count == 2) {
+                        float p = (weights[0].x + weights[0].y + weights[0].z) / 3;
+                        r = (paths.samplers[i].get1D() < p) ? 0 : 1;
+                        weights[r] = weights[r] * (1 / ((r == 0) ? p : 1 - p));
+                    }
+                    paths.rays.set(i, rays[r]);
+                    throughput = throughput * weights[r];
+                }
+                paths.alive[i] = survives(throughput, paths.samplers[i].get1D());
+            }
+            timer.lap(stats.shadingTime);
+            for (int s = 0; s < shadows.size(); s++) {	// shadow rays
+                uint64_t work = stats.work();
+                int i = shadows.paths[s];
+                if (!shadowIntersect(shadows.rays.get(s), shadows.lights[s])) {	// in two steps as directLight, for the same rounding
+                    paths.direct[i] = paths.direct[i] + shadows.diffuse[s];
+                    paths.direct[i] = paths.direct[i] + shadows.specular[s];
+                }
+                queues.works[paths.ids[i]] += stats.work() - work;
+            }
+            timer.lap(stats.traversalTime);
+            int live = 0;
+            for (int i = 0; i < n; i++) {	// compaction, the finished paths leave their radiance in the results
+                if (paths.t[i] >= 0 && paths.materials[i]->rough) {
+                    paths.radiance[i] = paths.radiance[i] + paths.weights[i] * paths.direct[i];
+                    paths.radiance[i] = paths.radiance[i] + paths.indirect[i];	// zero unless the cache ended the path
+                }
+                if (paths.alive[i] && depth + 1 < maxPathLength) paths.move(i, live++);
+                else queues.results[paths.ids[i]] = paths.radiance[i];
+            }
+            paths.truncate(live);
+            timer.lap(stats.shadingTime);
+        }
+    }
+};
@@ -0,0 +1,139 @@
+//=============================================================================================
+// Samplers of the path tracer. Every pixel gets its own generator seeded from the pixel coordinates,
+// so an image does not depend on the thread count or the order in which the tiles are rendered.
+// Included by raytracer.h after framework.h.
+//=============================================================================================
+#pragma once
+#include <stdint.h>
+
+enum SamplerType { RANDOM_SAMPLER, STRATIFIED_SAMPLER, SOBOL_SAMPLER, nSamplerTypes };
+static const char * const samplerNames[nSamplerTypes] = { "random", "stratified", "sobol" };
+
+inline uint32_t hash32(uint32_t x) {	// integer finalizer with low bias
+    x ^= x >> 16; x *= 0x7feb352d;
+    x ^= x >> 15; x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hashCombine(uint32_t seed, uint32_t v) { return hash32(seed ^ (v + 0x9e3779b9 + (seed << 6) + (seed >> 2))); }
+
+inline float toUniform(uint32_t x) { return (x >> 8) * (1.0f / 16777216.0f); }	// [0, 1) with 24 bits
+
+// PCG32 (O'Neill): 64 bit LCG state with a permuted 32 bit output, independent streams by the increment
+class PCG32 {
+    uint64_t state = 0, inc = 1;
+public:
+    void seed(uint64_t initState, uint64_t stream) {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next();
+        state += initState;
+        next();
+    }
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27), rot = (uint32_t)(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+    }
+    float uniform() { return toUniform(next()); }
+};
+
+// random permutation of [0, n) selected by seed (Kensler, Correlated Multi-Jittered Sampling)
+inline uint32_t permute(uint32_t i, uint32_t n, uint32_t seed) {
+    uint32_t w = n - 1;
+    w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+    do {
+        i ^= seed; i *= 0xe170893d; i ^= seed >> 16;
+        i ^= (i & w) >> 4; i ^= seed >> 8; i *= 0x0929eb3f;
+        i ^= seed >> 23; i ^= (i & w) >> 1; i *= 1 | seed >> 27;
+        i *= 0x6935fa69; i ^= (i & w) >> 11; i *= 0x74dcb303;
+        i ^= (i & w) >> 2; i *= 0x9e501cc3; i ^= (i & w) >> 2;
+        i *= 0xc860a3df; i &= w; i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+}
+
+inline uint32_t reverseBits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+// Owen scrambling of the bits of x by hashing (Burley, Practical Hash-based Owen Scrambling)
+inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return reverseBits(x);
+}
+
+inline uint32_t sobol2(uint32_t index) {	// second dimension of the Sobol sequence, the first one is reverseBits
+    uint32_t v = 1u << 31, result = 0;
+    for (; index; index >>= 1, v ^= v >> 1) if (index & 1) result ^= v;
+    return result;
+}
+
+// Sample sequence of one pixel. startSample(i) selects the i-th of samplesPerPixel samples, then the
+// dimensions of the sample (pixel position, bounce directions) are taken by get1D / get2D in order.
+// The random numbers of a sample depend on the pixel, the sample index and the dimension only, so
+// samples can be added to a pixel later by another sampler of the same pixel.
+//  RANDOM_SAMPLER:     white noise from the PCG stream of the pixel
+//  STRATIFIED_SAMPLER: jittered strata, shuffled independently in every dimension
+//  SOBOL_SAMPLER:      2D Sobol points, Owen scrambled and shuffled for every dimension pair
+class Sampler {
+    SamplerType type;
+    uint32_t samplesPerPixel, pixelSeed;
+    uint32_t sample = 0, dimension = 0;
+    PCG32 rng;
+
+    uint32_t dimensionSeed() { return hashCombine(pixelSeed, dimension++); }
+public:
+    Sampler(SamplerType _type, uint32_t seed, int X, int Y, int _samplesPerPixel)
+        : type(_type), samplesPerPixel(_samplesPerPixel > 0 ? _samplesPerPixel : 1) {
+        pixelSeed = hashCombine(hashCombine(hash32(seed), X), Y);
+    }
+
+    void startSample(int i) {
+        sample = i;
+        dimension = 0;
+        rng.seed(hashCombine(pixelSeed, i), pixelSeed);
+    }
+
+    float get1D() {
+        uint32_t seed = dimensionSeed();
+        switch (type) {
+        case STRATIFIED_SAMPLER: return (permute(sample % samplesPerPixel, samplesPerPixel, seed) + rng.uniform()) / samplesPerPixel;
+        case SOBOL_SAMPLER: return toUniform(owenScramble(reverseBits(owenScramble(sample, seed)), hash32(seed)));
+        default: return rng.uniform();
+        }
+    }
+
+    vec2 get2D() {
+        uint32_t seed = dimensionSeed();
+        switch (type) {
+        case STRATIFIED_SAMPLER: {
+            uint32_t nx = (uint32_t)sqrtf((float)samplesPerPixel), ny = (samplesPerPixel + nx - 1) / nx;
+            uint32_t stratum = permute(sample % samplesPerPixel, nx * ny, seed);
+            float u = rng.uniform(), v = rng.uniform();
+            return vec2((stratum % nx + u) / nx, (stratum / nx + v) / ny);
+        }
+        case SOBOL_SAMPLER: {
+            uint32_t index = owenScramble(sample, seed);
+            return vec2(toUniform(owenScramble(reverseBits(index), hashCombine(seed, 0))),
+                        toUniform(owenScramble(sobol2(index), hashCombine(seed, 1))));
+        }
+        default: {
+            float u = rng.uniform();
+            return vec2(u, rng.uniform());
+        }
+        }
+    }
+};
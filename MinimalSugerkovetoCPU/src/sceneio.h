@@ -0,0 +1,354 @@
+//=============================================================================================
+// Binary scene files. A file is a header, a table of sections and the sections, each aligned to 64
+// bytes: the camera, the materials, the lights, the spheres as structure of arrays, the vertices and
+// indices of the triangle meshes, and optionally a prebuilt BVH. The file is memory mapped; the mesh
+// arrays and the BVH are used in place, so a large scene is ready without parsing or building, and the
+// render processes of a machine share the pages of the file. Little endian, as written by x86.
+//=============================================================================================
+#pragma once
+#include "meshio.h"	// MappedFile, includes raytracer.h
+
+static const char sceneFileMagic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+static const uint32_t sceneFileVersion = 1;	// files of other versions are rejected
+
+enum SceneSectionType {
+    SECTION_CAMERA = 1, SECTION_MATERIALS, SECTION_LIGHTS,
+    SECTION_SPHERE_X, SECTION_SPHERE_Y, SECTION_SPHERE_Z, SECTION_SPHERE_RADIUS, SECTION_SPHERE_MATERIAL,
+    SECTION_MESHES, SECTION_VERTICES, SECTION_INDICES,
+    SECTION_BVH_NODES, SECTION_BVH_PRIMITIVES,	// optional, in the order spheres, then the faces of the meshes
+    nSectionTypes
+};
+
+struct SceneFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;		// followed by the section table
+};
+
+struct SceneSection {
+    uint32_t type;
+    uint32_t elementSize;		// checked against the record of the type
+    uint64_t offset;			// from the start of the file, aligned to 64 bytes
+    uint64_t count;
+};
+
+struct CameraRecord {
+    vec3 eye, lookat, vup;
+    float fov;
+    vec3 La;					// ambient light
+};
+
+struct MaterialRecord {
+    vec3 ka, kd, ks;
+    float shininess;
+    vec3 F0;
+    float ior;
+    uint32_t flags;				// 1: rough, 2: reflective, 4: refractive
+};
+
+struct LightRecord {
+    vec3 direction, Le;
+};
+
+struct MeshRecord {				// ranges of the vertex and index sections, indices count from firstVertex
+    uint64_t firstVertex, vertexCount, firstIndex, indexCount;
+    uint32_t material, padding;
+};
+
+static_assert(sizeof(vec3) == 12 && sizeof(uint32_t) == sizeof(PrimitiveRef) && sizeof(BVH::Node) == 32,
+              "the mesh and BVH sections are used in place and need the layout of the writer");
+
+struct SceneFileInfo {
+    size_t spheres = 0, triangles = 0, meshes = 0;
+    bool prebuiltBVH = false;
+};
+
+class SceneFile {
+    static const size_t alignment = 64;
+
+    struct Writer {
+        FILE * file;
+        uint64_t position = 0;
+        std::vector<SceneSection> sections;
+
+        template <class T> void add(uint32_t type, const T * data, size_t count) {
+            position = (position + alignment - 1) / alignment * alignment;
+            sections.push_back({ type, (uint32_t)sizeof(T), position, count });
+            position += sizeof(T) * count;
+            pending.push_back({ (const char *)data, sizeof(T) * count });
+        }
+        struct Block {
+            const char * data;
+            size_t size;
+        };
+        std::vector<Block> pending;
+
+        bool write() {
+            SceneFileHeader header;
+            memcpy(header.magic, sceneFileMagic, sizeof(header.magic));
+            header.version = sceneFileVersion;
+            header.sectionCount = (uint32_t)sections.size();
+            uint64_t start = (sizeof(header) + sizeof(SceneSection) * sections.size() + alignment - 1) / alignment * alignment;
+            for (SceneSection& section : sections) section.offset += start;
+            if (fwrite(&header, sizeof(header), 1, file) != 1) return false;
+            if (!sections.empty() && fwrite(sections.data(), sizeof(SceneSection), sections.size(), file) != sections.size()) return false;
+            uint64_t written = sizeof(header) + sizeof(SceneSection) * sections.size();
+            static const char zeros[alignment] = { 0 };
+            for (size_t i = 0; i < sections.size(); i++) {
+                if (fwrite(zeros, 1, sections[i].offset - written, file) != sections[i].offset - written) return false;
+                if (pending[i].size > 0 && fwrite(pending[i].data, 1, pending[i].size, file) != pending[i].size) return false;
+                written = sections[i].offset + pending[i].size;
+            }
+            return true;
+        }
+    };
+
+    // the section of type, checked to have records of T; count is 0 and the result null if it is missing
+    template <class T> static const T * section(const MappedFile& file, const SceneSection * table, uint32_t nSections,
+                                                uint32_t type, size_t& count, bool& valid) {
+        count = 0;
+        for (uint32_t i = 0; i < nSections; i++) {
+            if (table[i].type != type) continue;
+            const SceneSection& s = table[i];
+            if (s.elementSize != sizeof(T) || s.offset % alignment != 0 || s.offset > file.size() ||
+                s.count > (file.size() - s.offset) / sizeof(T)) {
+                printf("Scene file section %u is malformed\n", type);
+                valid = false;
+                return nullptr;
+            }
+            count = (size_t)s.count;
+            return (const T *)(file.data() + s.offset);
+        }
+        return nullptr;
+    }
+
+    struct Collector {	// arrays of the spheres and meshes, in the order of the primitives
+        const std::vector<Material *>& materials;
+        std::vector<float> x, y, z, radius;
+        std::vector<uint32_t> sphereMaterials, indices;
+        std::vector<vec3> vertices;
+        std::vector<MeshRecord> meshes;
+        const Mesh * mesh = nullptr;
+        uint32_t nextFace = 0;
+        bool contiguous = true;		// the faces of every mesh follow each other from the first one
+
+        Collector(const std::vector<Material *>& _materials) : materials(_materials) { }
+
+        uint32_t material(const Material * m) const {	// unknown materials become the first one
+            size_t i = std::find(materials.begin(), materials.end(), m) - materials.begin();
+            return (i < materials.size()) ? (uint32_t)i : 0;
+        }
+        void add(const Sphere& sphere) {
+            x.push_back(sphere.center.x); y.push_back(sphere.center.y); z.push_back(sphere.center.z);
+            radius.push_back(sphere.radius);
+            sphereMaterials.push_back(material(sphere.material));
+        }
+        void add(const Triangle& triangle) {
+            if (triangle.mesh != mesh || triangle.face != nextFace) {
+                if (triangle.face != 0 || (mesh && nextFace != mesh->faceCount())) contiguous = false;
+                mesh = triangle.mesh;
+                nextFace = 0;
+                meshes.push_back({ vertices.size(), mesh->vertexCount(), indices.size(), 3 * mesh->faceCount(), material(mesh->material), 0 });
+                vertices.insert(vertices.end(), mesh->vertexData(), mesh->vertexData() + mesh->vertexCount());
+                indices.insert(indices.end(), mesh->indexData(), mesh->indexData() + 3 * mesh->faceCount());
+            }
+            nextFace++;
+        }
+        void add(const Instance&) { }
+    };
+
+    static Material * makeMaterial(Scene& scene, const MaterialRecord& r) {
+        Material * material = scene.make<Material>(r.kd, r.ks, r.shininess);
+        material->ka = r.ka;
+        material->F0 = r.F0;
+        material->ior = r.ior;
+        material->rough = (r.flags & 1) != 0;
+        material->reflective = (r.flags & 2) != 0;
+        material->refractive = (r.flags & 4) != 0;
+        return material;
+    }
+
+public:
+    // Writes the spheres, the meshes of the triangles, the materials, lights and camera of scene, with its
+    // BVH if it is built. Instances are not supported.
+    static bool save(const std::string& pathname, const Scene& scene) {
+        if (scene.primitives.size(2) > 0) {	// kind 2: Instance
+            printf("Scenes with instances cannot be saved\n");
+            return false;
+        }
+        if (scene.materials.empty() && scene.primitives.size() > 0) {
+            printf("Scenes without materials cannot be saved\n");
+            return false;
+        }
+        CameraRecord camera;
+        scene.camera.get(camera.eye, camera.lookat, camera.vup, camera.fov);
+        camera.La = scene.La;
+        std::vector<MaterialRecord> materials;
+        for (const Material * m : scene.materials)
+            materials.push_back({ m->ka, m->kd, m->ks, m->shininess, m->F0, m->ior,
+                                  (m->rough ? 1u : 0u) | (m->reflective ? 2u : 0u) | (m->refractive ? 4u : 0u) });
+        std::vector<LightRecord> lights;
+        for (const Light * light : scene.lights) lights.push_back({ light->direction, light->Le });
+        Collector collector(scene.materials);
+        scene.primitives.forEach([&](const auto& primitive, PrimitiveRef) { collector.add(primitive); });
+        if (!collector.contiguous || (collector.mesh && collector.nextFace != collector.mesh->faceCount())) {
+            printf("The triangles of the meshes are not in order, the scene cannot be saved\n");
+            return false;
+        }
+
+        FILE * file = fopen(pathname.c_str(), "wb");
+        if (!file) {
+            printf("%s cannot be written\n", pathname.c_str());
+            return false;
+        }
+        Writer writer;
+        writer.file = file;
+        writer.add(SECTION_CAMERA, &camera, 1);
+        writer.add(SECTION_MATERIALS, materials.data(), materials.size());
+        writer.add(SECTION_LIGHTS, lights.data(), lights.size());
+        writer.add(SECTION_SPHERE_X, collector.x.data(), collector.x.size());
+        writer.add(SECTION_SPHERE_Y, collector.y.data(), collector.y.size());
+        writer.add(SECTION_SPHERE_Z, collector.z.data(), collector.z.size());
+        writer.add(SECTION_SPHERE_RADIUS, collector.radius.data(), collector.radius.size());
+        writer.add(SECTION_SPHERE_MATERIAL, collector.sphereMaterials.data(), collector.sphereMaterials.size());
+        writer.add(SECTION_MESHES, collector.meshes.data(), collector.meshes.size());
+        writer.add(SECTION_VERTICES, collector.vertices.data(), collector.vertices.size());
+        writer.add(SECTION_INDICES, collector.indices.data(), collector.indices.size());
+        if (scene.bvh.nodeCount() > 0) {
+            writer.add(SECTION_BVH_NODES, scene.bvh.nodeData(), scene.bvh.nodeCount());
+            writer.add(SECTION_BVH_PRIMITIVES, (const uint32_t *)scene.bvh.primitiveData(), scene.bvh.primitiveCount());
+        }
+        bool written = writer.write();
+        if (fclose(file) != 0) written = false;
+        if (!written) printf("%s cannot be written\n", pathname.c_str());
+        return written;
+    }
+
+    // Loads a scene file into an empty scene instead of Scene::build. The file stays mapped as long as
+    // the scene lives; the spheres are copied into the primitive arrays on the thread pool of the scene,
+    // the triangles refer to the mapped meshes and a prebuilt BVH is traversed in place.
+    static bool load(const std::string& pathname, Scene& scene, SceneFileInfo * info = nullptr) {
+        if (scene.primitives.size() > 0 || !scene.materials.empty()) {
+            printf("Scene files are loaded into empty scenes only\n");
+            return false;
+        }
+        std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+        if (!file->open(pathname)) {
+            printf("%s cannot be opened\n", pathname.c_str());
+            return false;
+        }
+        const SceneFileHeader * header = (const SceneFileHeader *)file->data();
+        if (file->size() < sizeof(SceneFileHeader) || memcmp(header->magic, sceneFileMagic, sizeof(sceneFileMagic)) != 0) {
+            printf("%s is not a scene file\n", pathname.c_str());
+            return false;
+        }
+        if (header->version != sceneFileVersion) {
+            printf("%s is a scene file of version %u, version %u is supported\n", pathname.c_str(), header->version, sceneFileVersion);
+            return false;
+        }
+        if (header->sectionCount > (file->size() - sizeof(SceneFileHeader)) / sizeof(SceneSection)) {
+            printf("%s is truncated\n", pathname.c_str());
+            return false;
+        }
+        const SceneSection * table = (const SceneSection *)(header + 1);
+        uint32_t nSections = header->sectionCount;
+        bool valid = true;
+        size_t nCameras, nMaterials, nLights, nX, nY, nZ, nRadius, nSphereMaterials, nMeshes, nVertices, nIndices, nNodes, nRefs;
+        const CameraRecord * camera = section<CameraRecord>(*file, table, nSections, SECTION_CAMERA, nCameras, valid);
+        const MaterialRecord * materials = section<MaterialRecord>(*file, table, nSections, SECTION_MATERIALS, nMaterials, valid);
+        const LightRecord * lights = section<LightRecord>(*file, table, nSections, SECTION_LIGHTS, nLights, valid);
+        const float * x = section<float>(*file, table, nSections, SECTION_SPHERE_X, nX, valid);
+        const float * y = section<float>(*file, table, nSections, SECTION_SPHERE_Y, nY, valid);
+        const float * z = section<float>(*file, table, nSections, SECTION_SPHERE_Z, nZ, valid);
+        const float * radius = section<float>(*file, table, nSections, SECTION_SPHERE_RADIUS, nRadius, valid);
+        const uint32_t * sphereMaterials = section<uint32_t>(*file, table, nSections, SECTION_SPHERE_MATERIAL, nSphereMaterials, valid);
+        const MeshRecord * meshes = section<MeshRecord>(*file, table, nSections, SECTION_MESHES, nMeshes, valid);
+        const vec3 * vertices = section<vec3>(*file, table, nSections, SECTION_VERTICES, nVertices, valid);
+        const uint32_t * indices = section<uint32_t>(*file, table, nSections, SECTION_INDICES, nIndices, valid);
+        const BVH::Node * nodes = section<BVH::Node>(*file, table, nSections, SECTION_BVH_NODES, nNodes, valid);
+        const uint32_t * refs = section<uint32_t>(*file, table, nSections, SECTION_BVH_PRIMITIVES, nRefs, valid);
+        if (!valid) return false;
+        size_t nSpheres = nX;
+        if (nCameras != 1 || nY != nSpheres || nZ != nSpheres || nRadius != nSpheres || nSphereMaterials != nSpheres ||
+            ((nSpheres > 0 || nMeshes > 0) && nMaterials == 0)) {
+            printf("%s misses sections\n", pathname.c_str());
+            return false;
+        }
+        size_t nTriangles = 0;
+        for (size_t m = 0; m < nMeshes; m++) {
+            const MeshRecord& mesh = meshes[m];
+            if (mesh.firstVertex > nVertices || mesh.vertexCount > nVertices - mesh.firstVertex || mesh.firstIndex > nIndices ||
+                mesh.indexCount > nIndices - mesh.firstIndex || mesh.indexCount % 3 != 0 || mesh.material >= nMaterials) {
+                printf("Mesh %zu of %s is malformed\n", m, pathname.c_str());
+                return false;
+            }
+            nTriangles += mesh.indexCount / 3;
+        }
+        if (nSpheres + nTriangles >= (1u << 28)) {	// PrimitiveRef::index
+            printf("%s has too many primitives\n", pathname.c_str());
+            return false;
+        }
+
+        ThreadPool& pool = scene.threadPool();
+        int nTasks = pool.size() * 4;
+        std::atomic<bool> malformed(false);
+        pool.run(nTasks, [&](int task, int) {	// the material and vertex indices are checked before anything is built
+            for (size_t i = nSpheres * task / nTasks; i < nSpheres * (task + 1) / nTasks; i++)
+                if (sphereMaterials[i] >= nMaterials) malformed = true;
+            for (size_t m = 0; m < nMeshes; m++) {
+                const uint32_t * index = indices + meshes[m].firstIndex;
+                size_t n = meshes[m].indexCount;
+                for (size_t i = n * task / nTasks; i < n * (task + 1) / nTasks; i++)
+                    if (index[i] >= meshes[m].vertexCount) malformed = true;
+            }
+        });
+        if (malformed) {
+            printf("%s has bad material or vertex indices\n", pathname.c_str());
+            return false;
+        }
+
+        scene.camera.set(camera->eye, camera->lookat, camera->vup, camera->fov);
+        scene.La = camera->La;
+        for (size_t m = 0; m < nMaterials; m++) scene.materials.push_back(makeMaterial(scene, materials[m]));
+        for (size_t l = 0; l < nLights; l++) {
+            scene.lights.push_back(scene.make<Light>(lights[l].direction, lights[l].Le));
+            scene.lights.back()->direction = lights[l].direction;	// normalized already, not rounded again
+        }
+
+        PrimitiveRef first = scene.primitives.add(Sphere(vec3(), 0, nullptr), nSpheres);
+        scene.spheres.append((int)nSpheres);
+        pool.run(nTasks, [&](int task, int) {
+            for (size_t i = nSpheres * task / nTasks; i < nSpheres * (task + 1) / nTasks; i++) {
+                PrimitiveRef ref(first.kind, first.index + (int)i);
+                Sphere& sphere = scene.primitives.get<Sphere>(ref);
+                sphere = Sphere(vec3(x[i], y[i], z[i]), radius[i], scene.materials[sphereMaterials[i]]);
+                scene.spheres.set((int)i, sphere.center, sphere.radius, ref);
+            }
+        });
+        for (size_t m = 0; m < nMeshes; m++) {
+            Mesh * mesh = scene.make<Mesh>();
+            mesh->view(vertices + meshes[m].firstVertex, meshes[m].vertexCount, indices + meshes[m].firstIndex, meshes[m].indexCount);
+            mesh->material = scene.materials[meshes[m].material];
+            scene.meshes.push_back(mesh);
+            uint32_t nFaces = (uint32_t)mesh->faceCount();
+            PrimitiveRef firstFace = scene.primitives.add(Triangle(mesh, 0), nFaces);
+            pool.run(nTasks, [&](int task, int) {
+                for (uint32_t face = (uint32_t)((uint64_t)nFaces * task / nTasks); face < (uint64_t)nFaces * (task + 1) / nTasks; face++)
+                    scene.primitives.get<Triangle>(PrimitiveRef(firstFace.kind, firstFace.index + face)).face = face;
+            });
+        }
+
+        bool prebuilt = nNodes > 0 && scene.bvh.attach(scene.primitives, nodes, (int)nNodes, (const PrimitiveRef *)refs, (int)nRefs);
+        if (nNodes > 0 && !prebuilt) printf("The BVH of %s is malformed, it is built again\n", pathname.c_str());
+        if (prebuilt) scene.buildCount++;
+        else scene.commit();
+        scene.mappings.push_back(file);
+        if (info) {
+            info->spheres = nSpheres;
+            info->triangles = nTriangles;
+            info->meshes = nMeshes;
+            info->prebuiltBVH = prebuilt;
+        }
+        return true;
+    }
+};
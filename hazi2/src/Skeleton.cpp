@@ -26,6 +26,8 @@
 #define INIT_TIME 1
 #define HUBBLE 0.1f
 
+#define BIN_SIZE 16     // kepernyo csempek merete: a csempe sugarai csak a csempere vetulo csillagokat tesztelik
+
 int tx = INIT_TIME;
 
 struct Hit {
@@ -41,12 +43,7 @@ struct Ray {
     Ray(vec3 _start, vec3 _dir) { start = _start; dir = normalize(_dir); }
 };
 
-class Intersectable {
-public:
-    virtual Hit intersect(const Ray& ray) = 0;
-};
-
-struct Star : public Intersectable {
+struct Star {
     vec3 center;
     float radius;
 
@@ -55,7 +52,7 @@ struct Star : public Intersectable {
         radius = _radius;
     }
 
-    Hit intersect(const Ray& ray) {
+    Hit intersect(const Ray& ray) const {
         Hit hit;
 
         // Hubble torvenyt alkalmazzuk a csillagok tavolodasara
@@ -178,6 +175,28 @@ public:
         up = normalize(cross(w, right)) * focus * tanf(fov / 2);
     }
 
+    // Azok a pixelek, amelyek sugarai eltalalhatjak a gombot: a szemen atmeno erinto sikok hatarolta
+    // teglalap fel pixellel kibovitve. false, ha egyik sugar sem talalhatja el.
+    bool pixelBounds(const vec3& center, float radius, int& X0, int& Y0, int& X1, int& Y1) const {
+        vec3 d = center - eye, forward = lookat - eye;
+        float focus = length(forward), z = dot(d, forward) / focus;
+        if (z < -radius) return false;
+        X0 = 0; Y0 = 0; X1 = windowWidth - 1; Y1 = windowHeight - 1;
+        float denominator = z * z - radius * radius;
+        if (z <= radius || denominator <= 1e-6f * z * z) return true;  // a szem mogotti reszre is kiter
+        auto range = [&](const vec3& axis, int resolution, int& lo, int& hi) {
+            float axisLength = length(axis), x = dot(d, axis) / axisLength, root = radius * sqrtf(x * x + denominator);
+            float scale = focus / axisLength * 0.5f * resolution;
+            float p0 = floorf((x * z - root) / denominator * scale + 0.5f * resolution - 0.5f);
+            float p1 = floorf((x * z + root) / denominator * scale + 0.5f * resolution + 0.5f);
+            if (p1 < 0 || p0 >= resolution) return false;
+            lo = (int)fmaxf(p0, 0.0f);
+            hi = (int)fminf(p1, resolution - 1.0f);
+            return true;
+        };
+        return range(right, windowWidth, X0, X1) && range(up, windowHeight, Y0, Y1);
+    }
+
     Ray getRay(int X, int Y) {
         vec3 dir = lookat + right * (2.0f * (X + 0.5f) / windowWidth - 1) + up * (2.0f * (Y + 0.5f) / windowHeight - 1) - eye;
         return Ray(eye, dir);
@@ -219,9 +238,28 @@ float max3(float a, float b, float c) {
 }
 
 class Scene {
-    std::vector<Star*> stars;
+    std::vector<Star> stars;   // ertekkent, egymas utan tarolva: nincs virtualis hivas es pointer kovetes
     Camera camera;
     float globalMaxVal = -1.0;
+    int nBinsX = (windowWidth + BIN_SIZE - 1) / BIN_SIZE, nBinsY = (windowHeight + BIN_SIZE - 1) / BIN_SIZE;
+    std::vector<std::vector<int>> bins; // csempenkent a rajuk vetulo csillagok indexei
+
+    // minden kepnel ujra: a csillagok a tagulas miatt mozognak, 100 csillagra ez joval olcsobb egy BVH-nal
+    void binStars() {
+        bins.resize(nBinsX * nBinsY);
+        for (std::vector<int>& bin : bins) bin.clear();
+        for (int i = 0; i < (int)stars.size(); i++) {
+            // a tavoli csillagokat a float metszes a sugarnal kicsit messzebbrol is eltalalja, ezert a sugar a
+            // tavolsag 0.001-szeresevel bovul
+            vec3 center = stars[i].center * exp(HUBBLE * tx);
+            float radius = sqrtf(stars[i].radius * stars[i].radius + 1e-6f * dot(center, center));
+            int X0, Y0, X1, Y1;
+            if (!camera.pixelBounds(center, radius, X0, Y0, X1, Y1)) continue;
+            for (int BY = Y0 / BIN_SIZE; BY <= Y1 / BIN_SIZE; BY++)
+                for (int BX = X0 / BIN_SIZE; BX <= X1 / BIN_SIZE; BX++)
+                    bins[BY * nBinsX + BX].push_back(i);
+        }
+    }
 public:
     void build() {
         float fov = 4 * M_PI / 180;
@@ -242,18 +280,18 @@ public:
             float y = distrY(gen);
             float z = distrZ(gen);
 
-            Star* star = new Star(vec3(x, y, z), RADIUS);
-            stars.push_back(star);
+            stars.push_back(Star(vec3(x, y, z), RADIUS));
         }
     }
 
     void render(std::vector<vec4>& image) {
         std::vector<vec4> tmpimage(windowWidth * windowHeight);
         float maxVal = -1.0;
+        binStars();
         for (int Y = 0; Y < windowHeight; Y++) {
 #pragma omp parallel for
             for (int X = 0; X < windowWidth; X++) {
-                Hit hit = trace(camera.getRay(X, Y));
+                Hit hit = trace(camera.getRay(X, Y), bins[(Y / BIN_SIZE) * nBinsX + X / BIN_SIZE]);
                 if (hit.t == -1) {
                     tmpimage[Y * windowWidth + X] = vec4(0.0f, 0.0f, 0.0f, 1.0f);
                 } else {
@@ -284,10 +322,10 @@ public:
         }
     }
 
-    Hit firstIntersect(Ray ray) {
+    Hit firstIntersect(Ray ray, const std::vector<int>& candidates) {   // a sugar csempejenek csillagai kozul
         Hit bestHit;
-        for (Intersectable * object : stars) {
-            Hit hit = object->intersect(ray); //  hit.t < 0 if no intersection
+        for (int i : candidates) {
+            Hit hit = stars[i].intersect(ray); //  hit.t < 0 if no intersection
             if (hit.t > 0 && (bestHit.t < 0 || hit.t < bestHit.t))
                 bestHit = hit;
         }
@@ -296,8 +334,8 @@ public:
         return bestHit;
     }
 
-    Hit trace(Ray ray) {
-        Hit hit = firstIntersect(ray);
+    Hit trace(Ray ray, const std::vector<int>& candidates) {
+        Hit hit = firstIntersect(ray, candidates);
         return hit;
     }
 };
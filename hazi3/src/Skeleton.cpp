@@ -3,12 +3,66 @@
 // Nev:     Babos David
 //=============================================================================================
 #include "framework.h"
+#include <algorithm>
+#include <new>
+#include <type_traits>
 
 #define NUM_PYRAMIDS 50
 #define MAX_BASE_SIZE 100.0f
 
 float rnd() { return (float) rand() / RAND_MAX; }
 
+//---------------------------
+class Arena { // storage of the scene entities, objects of one type are packed in blocks of that type
+//---------------------------
+    static const size_t blockSize = 1 << 16;
+    struct Pool {
+        std::vector<void *> blocks;
+        size_t objectSize = 0, blockCapacity = 0;
+        size_t count = 0;   // objects in use, the first count slots over the blocks
+        void (*destroy)(void *) = nullptr;  // null for trivially destructible types
+
+        void * allocate() {
+            size_t block = count / blockCapacity, slot = count % blockCapacity;
+            if (block == blocks.size()) blocks.push_back(::operator new(objectSize * blockCapacity));
+            count++;
+            return (char *)blocks[block] + slot * objectSize;
+        }
+        void clear() {  // nothing is visited for trivially destructible types
+            if (destroy) for (size_t i = count; i-- > 0;) destroy((char *)blocks[i / blockCapacity] + i % blockCapacity * objectSize);
+            count = 0;
+        }
+    };
+    std::vector<Pool> pools;    // indexed by typeIndex
+
+    static int nextTypeIndex() { static int n = 0; return n++; }
+    template <class T> static int typeIndex() { static const int index = nextTypeIndex(); return index; }
+public:
+    Arena() { }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() {
+        clear();
+        for (Pool& pool : pools)
+            for (void * block : pool.blocks) ::operator delete(block);
+    }
+
+    // the object is destroyed as a T by clear, so derived objects need no virtual destructor
+    template <class T, class... Args> T * make(Args&&... args) {
+        int index = typeIndex<T>();
+        if (index >= (int)pools.size()) pools.resize(index + 1);
+        Pool& pool = pools[index];
+        if (pool.objectSize == 0) {
+            pool.objectSize = sizeof(T);
+            pool.blockCapacity = std::max(blockSize / sizeof(T), (size_t)1);
+            if (!std::is_trivially_destructible<T>::value) pool.destroy = [](void * object) { ((T *)object)->~T(); };
+        }
+        return new (pool.allocate()) T(std::forward<Args>(args)...);
+    }
+
+    void clear() { for (Pool& pool : pools) pool.clear(); }    // the blocks are kept for the next build
+};
+
 //---------------------------
 struct Camera { // 3D camera
 //---------------------------
@@ -406,13 +460,13 @@ public:
 
     vec3 shift;
 
-    TrackObject(Shader * _shader, Material * _material, float _v) : Object(_shader, _material, nullptr) {
+    TrackObject(Arena& arena, Shader * _shader, Material * _material, float _v) : Object(_shader, _material, nullptr) {
         v = _v;
         float maxL = 12.0f * R + 2.0f * M_PI * R;
         float dl = maxL / numSegments;
         for (float l = 0.0f; l < maxL; l += dl) {
-            Geometry *trackSegmentGeo = new TrackSegmentGeo();
-            TrackSegmentObject *trackSegment = new TrackSegmentObject(shader, material, trackSegmentGeo, l, R, v);
+            Geometry *trackSegmentGeo = arena.make<TrackSegmentGeo>();
+            TrackSegmentObject *trackSegment = arena.make<TrackSegmentObject>(shader, material, trackSegmentGeo, l, R, v);
             trackSegment->translation = vec3(0, 1, 0);
             trackSegment->scale = vec3(0.12f, 1.0f, 1.0f);
             trackSegments.push_back(trackSegment);
@@ -453,9 +507,9 @@ struct TankObject : public Object {
     TrackObject *trackRight;
 
 public:
-    TankObject(Shader *pShader, Material *pMaterial) : Object(pShader, pMaterial, nullptr) {
-        trackLeft = new TrackObject(pShader, pMaterial, vl);
-        trackRight = new TrackObject(pShader, pMaterial, vr);
+    TankObject(Arena& arena, Shader *pShader, Material *pMaterial) : Object(pShader, pMaterial, nullptr) {
+        trackLeft = arena.make<TrackObject>(arena, pShader, pMaterial, vl);
+        trackRight = arena.make<TrackObject>(arena, pShader, pMaterial, vr);
     }
 
     void Animate(float tstart, float tend) {
@@ -509,6 +563,7 @@ public:
 //---------------------------
 class Scene {
 //---------------------------
+    Arena arena;    // owns the shader, materials, geometries and objects
     std::vector<Object *> objects;
     Camera camera; // 3D camera
     std::vector<Light> lights;
@@ -516,7 +571,7 @@ class Scene {
     Shader *shader;
 
     void generateRandomPyramids() {
-        Material *materialPyramid = new Material;
+        Material *materialPyramid = arena.make<Material>();
         materialPyramid->kd = vec3(0.7f, 0.7f, 0.7f);
         materialPyramid->ks = vec3(0.2f, 0.2f, 0.2f);
         materialPyramid->shininess = 3;
@@ -528,8 +583,8 @@ class Scene {
 
             // ne keruljon piramis pont a kozeppontba
             if (sqrtf(x * x + z * z) >= 15) {
-                Geometry *pyramid = new PyramidGeo();
-                Object *pyramidObject = new Object(shader, materialPyramid, pyramid);
+                Geometry *pyramid = arena.make<PyramidGeo>();
+                Object *pyramidObject = arena.make<Object>(shader, materialPyramid, pyramid);
                 pyramidObject->translation = vec3(x, -0.5f, z);
                 pyramidObject->scale = vec3(7.0f, 5.0f, 7.0f);
                 objects.push_back(pyramidObject);
@@ -541,24 +596,27 @@ class Scene {
 public:
     TankObject *tank;
 
-    void Build() {
+    void Build() { // replaces the current scene, the memory of the entities is reused
+        objects.clear();
+        arena.clear();
+
         // Shaders
-        shader = new CustomShader();
+        shader = arena.make<CustomShader>();
 
         // Materials
-        Material * material0 = new Material;
+        Material * material0 = arena.make<Material>();
         material0->kd = vec3(0.8f, 0.8f, 0.8f);
         material0->ks = vec3(0.0f, 0.0f, 0.0f);
         material0->shininess = 5;
 
-        Material *materialBase = new Material;
+        Material *materialBase = arena.make<Material>();
         materialBase->kd = vec3(0.76f, 0.682f, 0.117f);
         materialBase->ks = vec3(0.0f, 0.0f, 0.0f);
         materialBase->shininess = 0;
 
         // Create base
-        Geometry *base = new BaseGeo();
-        Object *baseObject = new Object(shader, materialBase, base);
+        Geometry *base = arena.make<BaseGeo>();
+        Object *baseObject = arena.make<Object>(shader, materialBase, base);
         baseObject->scale = vec3(3 * MAX_BASE_SIZE, 1.0f, 3 * MAX_BASE_SIZE);
         objects.push_back(baseObject);
 
@@ -566,7 +624,7 @@ public:
         generateRandomPyramids();
 
         // Create TankObject
-        tank = new TankObject(shader, material0);
+        tank = arena.make<TankObject>(arena, shader, material0);
         tank->rotationAxis = vec3(0, 1, 0);
         objects.push_back(tank);
 
@@ -579,6 +637,12 @@ public:
         lights[0].Le = vec3(2, 2, 2);
     }
 
+    void Release() { // the shader and the geometries free their GL objects, so the context must still exist
+        objects.clear();
+        tank = nullptr;
+        arena.clear();
+    }
+
     void Render() {
         RenderState state;
         state.wEye = camera.wEye;
@@ -598,12 +662,22 @@ public:
 
 Scene scene;
 
+// Window is closed, the OpenGL context is still alive
+void onClose() {
+    scene.Release();
+}
+
 // Initialization, create an OpenGL context
 void onInitialization() {
     glViewport(0, 0, windowWidth, windowHeight);
     glEnable(GL_DEPTH_TEST);
     glDisable(GL_CULL_FACE);
     scene.Build();
+#if defined(__APPLE__)
+    glutWMCloseFunc(onClose);
+#else
+    glutCloseFunc(onClose);
+#endif
 }
 
 // Window has become invalid: Redraw